@@ -0,0 +1,118 @@
+#include "misc.h"
+#include "sd_coalesce.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+typedef unsigned char u8_t;
+
+#define SEG_NONE    0xffffffffUL
+
+static struct {
+    u32_t seg, nseg, nvalid;    // first sector of segment, sectors per segment
+    u32_t valid[SD_COALESCE_BLOCKS / 32];
+    u32_t buf[SD_COALESCE_BLOCKS * 128];
+} c = {SEG_NONE, SD_COALESCE_BLOCKS};
+
+static bool is_valid(u32_t i)
+{
+    return (c.valid[i / 32] >> (i % 32)) & 1;
+}
+
+SD_Error SD_CoalesceInit(void)
+{
+    u32_t au = SD_GetAUSize() * 2;    // kbytes to sectors
+    c.nseg = SD_COALESCE_BLOCKS;
+    if(au && au < c.nseg)
+        c.nseg = au;
+    c.seg = SEG_NONE;
+    c.nvalid = 0;
+    memset(c.valid, 0, sizeof(c.valid));
+    return SD_OK;
+}
+
+SD_Error SD_CoalesceFlush(void)
+{
+    SD_Error ret = SD_OK;
+    u32_t i = 0, n;
+    if(c.seg == SEG_NONE)
+        return SD_OK;
+    /* a full segment goes out in one transfer, holes split it into runs */
+    while(i < c.nseg) {
+        if(!is_valid(i)) {
+            i++;
+            continue;
+        }
+        for(n = 1; i + n < c.nseg && is_valid(i + n); n++)
+            ;
+        ret = SD_WriteSectors(c.seg + i, (u8_t*)c.buf + i * 512, n);
+        if(ret != SD_OK)
+            return (ret);
+        i += n;
+    }
+    c.seg = SEG_NONE;
+    c.nvalid = 0;
+    memset(c.valid, 0, sizeof(c.valid));
+    return (ret);
+}
+
+SD_Error SD_CoalesceWrite(u32_t lba, const void* buff, u32_t nblocks)
+{
+    SD_Error ret = SD_OK;
+    const u8_t* p = buff;
+    if(buff == NULL)
+        return SD_INVALID_PARAMETER;
+    while(nblocks) {
+        u32_t seg = lba & ~(c.nseg - 1);
+        u32_t off = lba - seg, n = c.nseg - off;
+        if(n > nblocks)
+            n = nblocks;
+        if(off == 0 && n == c.nseg && ((u32_t)p & 3) == 0) {
+            /* whole aligned segments: all of them in one transfer straight
+             * from the caller's buffer, a buffered one among them is
+             * overwritten anyway */
+            n = nblocks & ~(c.nseg - 1);
+            if(c.seg != SEG_NONE && c.seg - lba < n) {
+                c.seg = SEG_NONE;
+                c.nvalid = 0;
+                memset(c.valid, 0, sizeof(c.valid));
+            }
+            ret = SD_WriteSectors(lba, p, n);
+        }
+        else {
+            if(seg != c.seg) {
+                if((ret = SD_CoalesceFlush()) != SD_OK)
+                    return (ret);
+                c.seg = seg;
+            }
+            memcpy((u8_t*)c.buf + off * 512, p, n * 512);
+            for(u32_t i = off; i < off + n; i++) {
+                if(!is_valid(i)) {
+                    c.valid[i / 32] |= 1UL << (i % 32);
+                    c.nvalid++;
+                }
+            }
+            if(c.nvalid == c.nseg)
+                ret = SD_CoalesceFlush();
+        }
+        if(ret != SD_OK)
+            return (ret);
+        lba += n;
+        p += n * 512;
+        nblocks -= n;
+    }
+    return (ret);
+}
+
+SD_Error SD_CoalesceRead(u32_t lba, void* buff, u32_t nblocks)
+{
+    SD_Error ret;
+    if(buff == NULL)
+        return SD_INVALID_PARAMETER;
+    if(c.seg != SEG_NONE && lba < c.seg + c.nseg && c.seg < lba + nblocks) {
+        ret = SD_CoalesceFlush();
+        if(ret != SD_OK)
+            return (ret);
+    }
+    return SD_ReadSectors(lba, buff, nblocks);
+}
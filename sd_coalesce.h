@@ -0,0 +1,24 @@
+#ifndef _SD_COALESCE_H
+#define _SD_COALESCE_H
+
+#include "sdio.h"
+
+/* Write coalescing in front of SD_WriteMultiBlocks. Small writes are
+ * gathered in one aligned segment, the AU or SD_COALESCE_BLOCKS sectors
+ * when the AU does not fit in RAM, and go to the card as a single
+ * multi-block write once the segment is full, a write leaves the segment
+ * or SD_CoalesceFlush() is called. A write covering whole segments sends
+ * all of them in one transfer from the caller's buffer; only its
+ * unaligned head and tail are buffered.
+ * All addresses are in 512 byte sectors. */
+#ifndef SD_COALESCE_BLOCKS
+#define SD_COALESCE_BLOCKS  64  /* 32 KiB of RAM, power of two */
+#endif
+
+SD_Error SD_CoalesceInit(void);
+SD_Error SD_CoalesceWrite(unsigned long lba, const void* buff,
+        unsigned long nblocks);
+SD_Error SD_CoalesceRead(unsigned long lba, void* buff, unsigned long nblocks);
+SD_Error SD_CoalesceFlush(void);
+
+#endif
@@ -0,0 +1,118 @@
+#include "misc.h"
+#include "sdio.h"
+#include "ff.h"
+#include "diskio.h"
+#include <stdbool.h>
+#include <string.h>
+
+/* FatFs (R0.14 and later) media access on drive 0 */
+
+typedef unsigned long u32_t;
+
+#ifndef SD_DISKIO_BOUNCE
+#define SD_DISKIO_BOUNCE    4   // sectors, for buffers the DMA cannot use
+#endif
+
+static DSTATUS dstat = STA_NOINIT;
+static u32_t bounce[SD_DISKIO_BOUNCE][128];
+
+static DRESULT result(SD_Error ret)
+{
+    return (ret == SD_OK) ? RES_OK : RES_ERROR;
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+    if(pdrv)
+        return STA_NOINIT;
+    if(SD_Init() == SD_OK)
+        dstat &= ~STA_NOINIT;
+    return dstat;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+    return pdrv ? STA_NOINIT : dstat;
+}
+
+/* count > 1 goes out as one multi-block transfer; buffers that are not
+ * word aligned, e.g. from f_read() into a byte array, go through bounce */
+DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+{
+    SD_Error ret = SD_OK;
+    UINT n;
+    if(pdrv || (count == 0))
+        return RES_PARERR;
+    if(dstat & STA_NOINIT)
+        return RES_NOTRDY;
+    if(((u32_t)buff & 3) == 0)
+        return result(SD_ReadSectors(sector, buff, count));
+    while(count && (ret == SD_OK)) {
+        n = (count > SD_DISKIO_BOUNCE) ? SD_DISKIO_BOUNCE : count;
+        ret = SD_ReadSectors(sector, bounce, n);
+        memcpy(buff, bounce, n * 512);
+        sector += n;
+        buff += n * 512;
+        count -= n;
+    }
+    return result(ret);
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+{
+    SD_Error ret = SD_OK;
+    UINT n;
+    if(pdrv || (count == 0))
+        return RES_PARERR;
+    if(dstat & STA_NOINIT)
+        return RES_NOTRDY;
+    if(((u32_t)buff & 3) == 0)
+        return result(SD_WriteSectors(sector, buff, count));
+    while(count && (ret == SD_OK)) {
+        n = (count > SD_DISKIO_BOUNCE) ? SD_DISKIO_BOUNCE : count;
+        memcpy(bounce, buff, n * 512);
+        ret = SD_WriteSectors(sector, bounce, n);
+        sector += n;
+        buff += n * 512;
+        count -= n;
+    }
+    return result(ret);
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    SD_Error ret = SD_OK;
+    LBA_t* range;
+    bool busy;
+    if(pdrv)
+        return RES_PARERR;
+    if(dstat & STA_NOINIT)
+        return RES_NOTRDY;
+    switch(cmd) {
+    case CTRL_SYNC:    // posted write programmed, card cache written
+        do {
+            ret = SD_CardBusy(&busy);
+        } while((ret == SD_OK) && busy);
+        if(ret == SD_OK)
+            ret = SD_Flush();
+        return result(ret);
+    case GET_SECTOR_COUNT:    // 32 bit lba, 2 TiB less a sector at most
+        *(LBA_t*)buff = (SD_GetCardSize() >= 0x80000000UL) ? 0xffffffffUL
+                : (LBA_t)SD_GetCardSize() * 2;
+        return RES_OK;
+#if FF_MAX_SS != FF_MIN_SS
+    case GET_SECTOR_SIZE:
+        *(WORD*)buff = 512;
+        return RES_OK;
+#endif
+    case GET_BLOCK_SIZE:    // erase block: the AU, 1 when unknown
+        *(DWORD*)buff = SD_GetAUSize() ? SD_GetAUSize() * 2 : 1;
+        return RES_OK;
+    case CTRL_TRIM:
+        range = buff;
+        ret = SD_EraseSectors(range[0], range[1]);
+        return (ret == SD_REQUEST_NOT_APPLICABLE) ? RES_OK : result(ret);
+    default:
+        return RES_PARERR;
+    }
+}
@@ -0,0 +1,210 @@
+#include "misc.h"
+#include "sd_integrity.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+
+#define NONE    0xffffffffUL
+
+static struct {
+    u32_t meta, data, nsectors, clock;
+    const u32_t* src;       // DMA progress hook state
+    u32_t nbytes, fed;
+    bool ahead;
+    u32_t crc[SD_INTEGRITY_CHUNK];
+    struct {
+        u32_t idx, used;    // metadata sector index, NONE: free; LRU clock
+        bool dirty;
+        u32_t crc[128];
+    } c[SD_INTEGRITY_CACHE];
+    SD_IntegrityStats st;
+} it;
+
+/* CRCs that collide with the "unknown" markers are stored as 1 */
+static u32_t stored(u32_t crc)
+{
+    return ((crc == 0) || (crc == NONE)) ? 1 : crc;
+}
+
+/* DMA progress hook: CRC unit over what the DMA has covered */
+static void feed(u32_t done)
+{
+    u32_t end = it.ahead ? it.nbytes : (done & ~3UL);
+    while(it.fed < end) {
+        CRC->DR = it.src[it.fed / 4];
+        it.fed += 4;
+        if(it.fed % 512)
+            continue;
+        it.crc[it.fed / 512 - 1] = stored(CRC->DR);
+        CRC->CR = CRC_CR_RESET;
+    }
+}
+
+static SD_Error write_back(u32_t i)
+{
+    SD_Error ret;
+    if(!it.c[i].dirty)
+        return SD_OK;
+    ret = SD_WriteSectors(it.meta + it.c[i].idx, it.c[i].crc, 1);
+    if(ret != SD_OK)
+        return (ret);
+    it.c[i].dirty = false;
+    it.st.meta_writes++;
+    return SD_OK;
+}
+
+/* cached metadata sector idx, NULL on a card error */
+static u32_t* meta_get(u32_t idx, bool dirty, SD_Error* pret)
+{
+    u32_t i, lru = 0;
+    for(i = 0; i < SD_INTEGRITY_CACHE; i++) {
+        if(it.c[i].idx == idx)
+            break;
+        if(it.c[i].used < it.c[lru].used)
+            lru = i;
+    }
+    if(i == SD_INTEGRITY_CACHE) {
+        i = lru;
+        *pret = write_back(i);
+        if(*pret != SD_OK)
+            return NULL;
+        it.c[i].idx = NONE;
+        *pret = SD_ReadSectors(it.meta + idx, it.c[i].crc, 1);
+        if(*pret != SD_OK)
+            return NULL;
+        it.c[i].idx = idx;
+        it.st.meta_reads++;
+    }
+    it.c[i].used = ++it.clock;
+    it.c[i].dirty |= dirty;
+    return it.c[i].crc;
+}
+
+static SD_Error transfer(bool write, u32_t lba, const void* buff, u32_t n)
+{
+    SD_Error ret;
+    it.src = buff;
+    it.nbytes = n * 512;
+    it.fed = 0;
+    it.ahead = write;
+    CRC->CR = CRC_CR_RESET;
+    SD_SetDmaProgress(feed);
+    if(write)
+        ret = SD_WriteSectors(lba, buff, n);
+    else
+        ret = SD_ReadSectors(lba, (void*)buff, n);
+    SD_SetDmaProgress(NULL);
+    if(ret == SD_OK)
+        feed(it.nbytes);    // paths without DMA progress, e.g. command queue
+    return (ret);
+}
+
+SD_Error SD_IntegrityInit(u32_t meta_lba, u32_t data_lba, u32_t nsectors)
+{
+    u32_t i;
+    if((nsectors == 0) || ((meta_lba < data_lba + nsectors)
+            && (data_lba < meta_lba + (nsectors + 127) / 128)))
+        return SD_INVALID_PARAMETER;
+    SD_CRC_CLOCK_ON();
+    it.meta = meta_lba;
+    it.data = data_lba;
+    it.nsectors = nsectors;
+    for(i = 0; i < SD_INTEGRITY_CACHE; i++) {
+        it.c[i].idx = NONE;
+        it.c[i].used = 0;
+        it.c[i].dirty = false;
+    }
+    memset(&it.st, 0, sizeof(it.st));
+    return SD_OK;
+}
+
+SD_Error SD_IntegrityFormat(void)
+{
+    u32_t i;
+    for(i = 0; i < SD_INTEGRITY_CACHE; i++) {
+        it.c[i].idx = NONE;
+        it.c[i].dirty = false;
+    }
+    return SD_EraseSectors(it.meta, it.meta + (it.nsectors + 127) / 128 - 1);
+}
+
+SD_Error SD_IntegrityWrite(u32_t lba, const void* buff, u32_t nblocks)
+{
+    SD_Error ret = SD_OK;
+    const char* p = buff;
+    u32_t n, i, k, *m;
+    if((buff == NULL) || ((u32_t)buff & 3) || (lba < it.data)
+            || (nblocks > it.nsectors) || (lba - it.data > it.nsectors - nblocks))
+        return SD_INVALID_PARAMETER;
+    while(nblocks) {
+        n = (nblocks > SD_INTEGRITY_CHUNK) ? SD_INTEGRITY_CHUNK : nblocks;
+        ret = transfer(true, lba, p, n);
+        for(i = 0; (i < n) && (ret == SD_OK); i++) {
+            k = lba + i - it.data;
+            m = meta_get(k / 128, true, &ret);
+            if(m)
+                m[k % 128] = it.crc[i];
+        }
+        if(ret != SD_OK)
+            return (ret);
+        it.st.written += n;
+        lba += n;
+        p += n * 512;
+        nblocks -= n;
+    }
+    return SD_OK;
+}
+
+SD_Error SD_IntegrityRead(u32_t lba, void* buff, u32_t nblocks)
+{
+    SD_Error ret = SD_OK;
+    char* p = buff;
+    u32_t n, i, k, *m;
+    bool bad = false;
+    if((buff == NULL) || ((u32_t)buff & 3) || (lba < it.data)
+            || (nblocks > it.nsectors) || (lba - it.data > it.nsectors - nblocks))
+        return SD_INVALID_PARAMETER;
+    while(nblocks) {
+        n = (nblocks > SD_INTEGRITY_CHUNK) ? SD_INTEGRITY_CHUNK : nblocks;
+        ret = transfer(false, lba, p, n);
+        for(i = 0; (i < n) && (ret == SD_OK); i++) {
+            k = lba + i - it.data;
+            m = meta_get(k / 128, false, &ret);
+            if(m == NULL)
+                break;
+            if((m[k % 128] == 0) || (m[k % 128] == NONE))
+                it.st.unknown++;
+            else if(m[k % 128] != it.crc[i]) {
+                if(!it.st.mismatches++)
+                    it.st.bad_lba = lba + i;
+                bad = true;
+            }
+            else
+                it.st.verified++;
+        }
+        if(ret != SD_OK)
+            return (ret);
+        it.st.read += n;
+        lba += n;
+        p += n * 512;
+        nblocks -= n;
+    }
+    return bad ? SD_ERROR : SD_OK;
+}
+
+SD_Error SD_IntegrityFlush(void)
+{
+    SD_Error ret = SD_OK;
+    u32_t i;
+    for(i = 0; (i < SD_INTEGRITY_CACHE) && (ret == SD_OK); i++)
+        ret = write_back(i);
+    return (ret);
+}
+
+void SD_IntegrityGetStats(SD_IntegrityStats* st, bool reset)
+{
+    *st = it.st;
+    if(reset)
+        memset(&it.st, 0, sizeof(it.st));
+}
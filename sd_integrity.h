@@ -0,0 +1,41 @@
+#ifndef _SD_INTEGRITY_H
+#define _SD_INTEGRITY_H
+
+#include "sdio.h"
+
+/* Per sector CRC32 kept in a reserved metadata area, 128 CRCs per metadata
+ * sector. CRCs come from the CRC unit while the DMA moves the data, reads
+ * are checked against the stored CRC. Metadata sectors are cached and
+ * written back on eviction or SD_IntegrityFlush(), so small writes share
+ * one metadata write. Data goes to the card before its CRC: a crash before
+ * the flush shows up as a mismatch, never as silently accepted data.
+ * A stored 0 or 0xffffffff means no CRC known (erased metadata).
+ * All addresses are in 512 byte sectors. */
+#ifndef SD_INTEGRITY_CACHE
+#define SD_INTEGRITY_CACHE  4   // metadata sectors cached
+#endif
+#ifndef SD_INTEGRITY_CHUNK
+#define SD_INTEGRITY_CHUNK  32  // sectors per transfer
+#endif
+
+typedef struct {
+    unsigned long written, read;    // data sectors
+    unsigned long verified, unknown;    // read sectors checked, without CRC
+    unsigned long mismatches, bad_lba;  // bad_lba: first mismatching sector
+    unsigned long meta_reads, meta_writes;
+} SD_IntegrityStats;
+
+/* data sectors [data_lba, data_lba + nsectors) get their CRCs in the
+ * (nsectors + 127) / 128 sectors from meta_lba on */
+SD_Error SD_IntegrityInit(unsigned long meta_lba, unsigned long data_lba,
+        unsigned long nsectors);
+/* forget all CRCs by erasing the metadata area */
+SD_Error SD_IntegrityFormat(void);
+SD_Error SD_IntegrityWrite(unsigned long lba, const void* buff,
+        unsigned long nblocks);
+/* SD_ERROR when a sector does not match its CRC */
+SD_Error SD_IntegrityRead(unsigned long lba, void* buff, unsigned long nblocks);
+SD_Error SD_IntegrityFlush(void);
+void SD_IntegrityGetStats(SD_IntegrityStats* st, bool reset);
+
+#endif
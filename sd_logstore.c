@@ -0,0 +1,337 @@
+#include "misc.h"
+#include "sd_logstore.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+typedef unsigned short u16_t;
+typedef unsigned char u8_t;
+
+#define LOG_MAGIC   0x474f4c53UL    // "SLOG"
+#define HDR_SIZE    20
+#define REC_HDR     6       // u32 time, u16 length
+#define IDX_ENTRIES 127     // index sector: generation, then entries
+#define NONE        0xffffffffUL
+
+/* data sector header, records follow */
+typedef struct {
+    u32_t magic, gen, seq, first;   // first: time of the first record
+    u16_t nrec, used;       // used: bytes including this header
+} Hdr;
+
+static struct {
+    u32_t lba, gen, nidx, data, ndata;  // layout
+    u32_t head, nb, last;   // sectors on the card, closed in batch; last time
+    u32_t ixsec, rsec;      // sector in idx, in rbuf; NONE
+    bool ixdirty;
+    SD_LogStats st;
+    u32_t idx[128];
+    u32_t rbuf[128];
+    u32_t batch[SD_LOG_BATCH][128];
+} l;
+
+static Hdr* batch_hdr(void)
+{
+    return (Hdr*)l.batch[l.nb];
+}
+
+/* data sector i into rbuf */
+static SD_Error rd(u32_t i)
+{
+    SD_Error ret;
+    if(l.rsec == i)
+        return SD_OK;
+    l.rsec = NONE;
+    ret = SD_ReadSectors(l.data + i, l.rbuf, 1);
+    if(ret != SD_OK)
+        return (ret);
+    l.rsec = i;
+    l.st.seek_reads++;
+    return SD_OK;
+}
+
+static bool valid(u32_t i)
+{
+    const Hdr* h = (const Hdr*)l.rbuf;
+    return (h->magic == LOG_MAGIC) && (h->gen == l.gen) && (h->seq == i);
+}
+
+static SD_Error ix_flush(void)
+{
+    SD_Error ret;
+    if(!l.ixdirty)
+        return SD_OK;
+    ret = SD_WriteSectors(l.lba + 1 + l.ixsec, l.idx, 1);
+    if(ret == SD_OK)
+        l.ixdirty = false;
+    return (ret);
+}
+
+static SD_Error ix_load(u32_t s)
+{
+    SD_Error ret;
+    if(l.ixsec == s)
+        return SD_OK;
+    ret = ix_flush();
+    if(ret == SD_OK)
+        ret = SD_ReadSectors(l.lba + 1 + s, l.idx, 1);
+    if(ret != SD_OK)
+        return (ret);
+    if(l.idx[0] != l.gen) {     // not written in this generation
+        memset(l.idx, 0xff, sizeof(l.idx));
+        l.idx[0] = l.gen;
+    }
+    l.ixsec = s;
+    return SD_OK;
+}
+
+/* time of the first record of group g, from its sector if the entry was
+ * lost with an index that was not synced */
+static SD_Error group_time(u32_t g, u32_t* time)
+{
+    SD_Error ret = ix_load(g / IDX_ENTRIES);
+    if(ret != SD_OK)
+        return (ret);
+    *time = l.idx[1 + g % IDX_ENTRIES];
+    if(*time != NONE)
+        return SD_OK;
+    ret = rd(g * SD_LOG_EVERY);
+    *time = ((const Hdr*)l.rbuf)->first;
+    return (ret);
+}
+
+/* record at cur, moving over sector ends */
+static SD_Error peek(SD_LogCursor* cur, u32_t* time, u16_t* len, u8_t** rec)
+{
+    SD_Error ret;
+    u8_t* p;
+    for(;;) {
+        if(cur->sector >= l.head)
+            return SD_REQUEST_NOT_APPLICABLE;
+        ret = rd(cur->sector);
+        if(ret != SD_OK)
+            return (ret);
+        if(cur->off < HDR_SIZE)
+            cur->off = HDR_SIZE;
+        if(cur->off + REC_HDR <= ((const Hdr*)l.rbuf)->used)
+            break;
+        cur->sector++;
+        cur->off = HDR_SIZE;
+    }
+    p = (u8_t*)l.rbuf + cur->off;
+    memcpy(time, p, 4);
+    memcpy(len, p + 4, 2);
+    *rec = p + REC_HDR;
+    return SD_OK;
+}
+
+static SD_Error write_batch(void)
+{
+    SD_Error ret;
+    if(l.nb == 0)
+        return SD_OK;
+    ret = SD_WriteSectors(l.data + l.head, l.batch, l.nb);
+    if(ret != SD_OK)
+        return (ret);
+    if((l.rsec >= l.head) && (l.rsec < l.head + l.nb))
+        l.rsec = NONE;
+    l.head += l.nb;
+    l.nb = 0;
+    batch_hdr()->nrec = 0;
+    l.st.writes++;
+    return SD_OK;
+}
+
+SD_Error SD_LogFormat(u32_t lba, u32_t nsectors)
+{
+    SD_Error ret;
+    u32_t groups = (nsectors + SD_LOG_EVERY - 1) / SD_LOG_EVERY;
+    if(nsectors < 3 + (groups + IDX_ENTRIES - 1) / IDX_ENTRIES)
+        return SD_INVALID_PARAMETER;
+    ret = SD_ReadSectors(lba, l.rbuf, 1);
+    if(ret != SD_OK)
+        return (ret);
+    /* a new generation hides what the old format left on the card */
+    l.rbuf[1] = (l.rbuf[0] == LOG_MAGIC) ? l.rbuf[1] + 1 : SD_TICKS();
+    l.rbuf[0] = LOG_MAGIC;
+    l.rbuf[2] = nsectors;
+    ret = SD_WriteSectors(lba, l.rbuf, 1);
+    if(ret != SD_OK)
+        return (ret);
+    return SD_LogMount(lba);
+}
+
+SD_Error SD_LogMount(u32_t lba)
+{
+    SD_Error ret;
+    SD_LogCursor cur = {0, 0};
+    u32_t lo, hi, mid, groups, time;
+    u16_t len;
+    u8_t* rec;
+    memset(&l.st, 0, sizeof(l.st));
+    l.ndata = 0;
+    l.rsec = l.ixsec = NONE;
+    l.ixdirty = false;
+    ret = SD_ReadSectors(lba, l.rbuf, 1);
+    if(ret != SD_OK)
+        return (ret);
+    if(l.rbuf[0] != LOG_MAGIC)
+        return SD_ERROR;
+    l.lba = lba;
+    l.gen = l.rbuf[1];
+    groups = (l.rbuf[2] + SD_LOG_EVERY - 1) / SD_LOG_EVERY;
+    l.nidx = (groups + IDX_ENTRIES - 1) / IDX_ENTRIES;
+    l.data = lba + 1 + l.nidx;
+    l.ndata = l.rbuf[2] - 1 - l.nidx;
+    l.nb = 0;
+    batch_hdr()->nrec = 0;
+    /* written sectors are valid, the rest not: first invalid is the head */
+    for(lo = 0, hi = l.ndata; lo < hi;) {
+        mid = (lo + hi) / 2;
+        ret = rd(mid);
+        if(ret != SD_OK)
+            return (ret);
+        if(valid(mid))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    l.head = lo;
+    l.last = 0;
+    cur.sector = lo ? lo - 1 : 0;
+    while((ret = peek(&cur, &time, &len, &rec)) == SD_OK) {
+        l.last = time;
+        cur.off += REC_HDR + len;
+    }
+    return (ret == SD_REQUEST_NOT_APPLICABLE) ? SD_OK : ret;
+}
+
+SD_Error SD_LogAppend(u32_t time, const void* rec, u32_t len)
+{
+    SD_Error ret;
+    Hdr* h;
+    u8_t* p;
+    u32_t seq;
+    u16_t len16 = len;
+    if(l.ndata == 0)
+        return SD_REQUEST_NOT_APPLICABLE;   // not mounted
+    if(((rec == NULL) && len) || (len > SD_LOG_MAX_REC) || (time < l.last))
+        return SD_INVALID_PARAMETER;
+    if(l.nb == SD_LOG_BATCH) {
+        ret = write_batch();
+        if(ret != SD_OK)
+            return (ret);
+    }
+    h = batch_hdr();
+    if(h->nrec && (h->used + REC_HDR + len > 512)) {    // close the sector
+        if(++l.nb == SD_LOG_BATCH) {
+            ret = write_batch();
+            if(ret != SD_OK)
+                return (ret);
+        }
+        h = batch_hdr();
+        h->nrec = 0;
+    }
+    if(h->nrec == 0) {
+        seq = l.head + l.nb;
+        if(seq >= l.ndata)
+            return SD_ERROR;    // full
+        if(seq % SD_LOG_EVERY == 0) {
+            ret = ix_load(seq / SD_LOG_EVERY / IDX_ENTRIES);
+            if(ret != SD_OK)
+                return (ret);
+            l.idx[1 + seq / SD_LOG_EVERY % IDX_ENTRIES] = time;
+            l.ixdirty = true;
+        }
+        h->magic = LOG_MAGIC;
+        h->gen = l.gen;
+        h->seq = seq;
+        h->first = time;
+        h->used = HDR_SIZE;
+    }
+    p = (u8_t*)h + h->used;
+    memcpy(p, &time, 4);
+    memcpy(p + 4, &len16, 2);
+    memcpy(p + REC_HDR, rec, len);
+    h->used += REC_HDR + len;
+    h->nrec++;
+    l.last = time;
+    l.st.records++;
+    return SD_OK;
+}
+
+SD_Error SD_LogSync(void)
+{
+    SD_Error ret;
+    if((l.nb < SD_LOG_BATCH) && batch_hdr()->nrec)
+        l.nb++;
+    ret = write_batch();
+    if(ret != SD_OK)
+        return (ret);
+    return ix_flush();
+}
+
+SD_Error SD_LogSeek(u32_t time, SD_LogCursor* cur)
+{
+    SD_Error ret;
+    u32_t lo, hi, mid, t, g;
+    u16_t len;
+    u8_t* rec;
+    l.st.seek_reads = 0;
+    /* last group, then last sector in it, whose first record is < time */
+    for(lo = 0, hi = (l.head + SD_LOG_EVERY - 1) / SD_LOG_EVERY; lo < hi;) {
+        mid = (lo + hi) / 2;
+        ret = group_time(mid, &t);
+        if(ret != SD_OK)
+            return (ret);
+        if(t < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    g = lo ? lo - 1 : 0;
+    lo = g * SD_LOG_EVERY + 1;
+    hi = (g + 1) * SD_LOG_EVERY;
+    if(hi > l.head)
+        hi = l.head;
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        ret = rd(mid);
+        if(ret != SD_OK)
+            return (ret);
+        if(((const Hdr*)l.rbuf)->first < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    cur->sector = lo - 1;
+    cur->off = HDR_SIZE;
+    /* then record by record, at most into the next sector */
+    while((ret = peek(cur, &t, &len, &rec)) == SD_OK) {
+        if(t >= time)
+            break;
+        cur->off += REC_HDR + len;
+    }
+    return (ret == SD_REQUEST_NOT_APPLICABLE) ? SD_OK : ret;
+}
+
+SD_Error SD_LogNext(SD_LogCursor* cur, u32_t* time, void* buff, u32_t* len)
+{
+    SD_Error ret;
+    u16_t n;
+    u8_t* rec;
+    ret = peek(cur, time, &n, &rec);
+    if(ret != SD_OK)
+        return (ret);
+    memcpy(buff, rec, n);
+    *len = n;
+    cur->off += REC_HDR + n;
+    return SD_OK;
+}
+
+void SD_LogGetStats(SD_LogStats* st)
+{
+    l.st.head = l.head;
+    l.st.size = l.ndata;
+    *st = l.st;
+}
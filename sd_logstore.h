@@ -0,0 +1,47 @@
+#ifndef _SD_LOGSTORE_H
+#define _SD_LOGSTORE_H
+
+#include "sdio.h"
+
+/* Append-only record store on a raw partition. Records carry a time that
+ * never decreases and are packed into sectors that are only ever written
+ * at the head, SD_LOG_BATCH at a time. Layout from the partition start:
+ *   superblock | index sectors | data sectors
+ * Every data sector starts with magic, format generation, its own index
+ * and the time of its first record, so the head is found at mount by a
+ * binary search. The index holds the first time of every SD_LOG_EVERY-th
+ * data sector; a seek is a binary search over the index and then over the
+ * sector headers of one group, O(log n) sector reads in all.
+ * Records do not span sectors: at most SD_LOG_MAX_REC bytes. */
+#ifndef SD_LOG_BATCH
+#define SD_LOG_BATCH    8   // sectors per card write
+#endif
+#ifndef SD_LOG_EVERY
+#define SD_LOG_EVERY    64  // data sectors per index entry
+#endif
+#define SD_LOG_MAX_REC  (512 - 20 - 6)
+
+typedef struct {
+    unsigned long sector, off;  // data sector, byte in it
+} SD_LogCursor;
+
+typedef struct {
+    unsigned long head, size;   // data sectors written, available
+    unsigned long records, writes;
+    unsigned long seek_reads;   // sector reads of the last seek
+} SD_LogStats;
+
+/* new empty store of nsectors from lba on, old data becomes invisible */
+SD_Error SD_LogFormat(unsigned long lba, unsigned long nsectors);
+SD_Error SD_LogMount(unsigned long lba);
+SD_Error SD_LogAppend(unsigned long time, const void* rec, unsigned long len);
+/* write the batch and the index, the open sector is closed */
+SD_Error SD_LogSync(void);
+/* cursor at the first record with a time >= time */
+SD_Error SD_LogSeek(unsigned long time, SD_LogCursor* cur);
+/* SD_REQUEST_NOT_APPLICABLE at the head, buff takes SD_LOG_MAX_REC */
+SD_Error SD_LogNext(SD_LogCursor* cur, unsigned long* time, void* buff,
+        unsigned long* len);
+void SD_LogGetStats(SD_LogStats* st);
+
+#endif
@@ -0,0 +1,306 @@
+#include "misc.h"
+#include "sd_lz.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+typedef unsigned short u16_t;
+typedef unsigned char u8_t;
+
+#define MIN_MATCH   4
+#define MFLIMIT     12  // LZ4: no match starts in the last 12 bytes
+#define LASTLITERALS    5
+
+typedef struct {
+    u32_t magic, seq;
+    u16_t raw, len;
+} Hdr;
+
+#define HDR_SIZE    sizeof(Hdr)     // 12 bytes on the target
+#define RD_SECTORS  ((SD_LZ_BLOCK + HDR_SIZE) / 512 + 2)
+
+static struct {
+    u32_t lba, seq, fill, nin;  // fill: bytes in out, nin: bytes in in
+    SD_LzStats st;
+    u16_t hash[1 << SD_LZ_HASH_LOG];
+    u8_t in[SD_LZ_BLOCK], tmp[SD_LZ_BLOCK];
+    u32_t out[SD_LZ_OUT][128];
+} z;
+
+static u32_t rd[RD_SECTORS][128];
+
+static u32_t read32(const u8_t* p)
+{
+    u32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static u8_t* put_len(u8_t* op, u32_t len)
+{
+    if(len >= 15) {
+        for(len -= 15; len >= 255; len -= 255)
+            *op++ = 255;
+        *op++ = len;
+    }
+    return op;
+}
+
+/* one sequence: literals, then a match unless off is 0; NULL if no room */
+static u8_t* emit(u8_t* op, u8_t* oend, const u8_t* lit, u32_t nlit,
+        u32_t off, u32_t mlen)
+{
+    u8_t* tok = op;
+    if(nlit + nlit / 255 + mlen / 255 + 6 > (u32_t)(oend - op))
+        return NULL;
+    *op++ = (nlit >= 15 ? 15 : nlit) << 4;
+    op = put_len(op, nlit);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if(off) {
+        *op++ = off;
+        *op++ = off >> 8;
+        *tok |= (mlen >= 15) ? 15 : mlen;
+        op = put_len(op, mlen);
+    }
+    return op;
+}
+
+/* greedy single probe LZ4 block compressor, 0 if dst is too small */
+static u32_t lz_encode(const u8_t* src, u32_t n, u8_t* dst, u32_t cap)
+{
+    const u8_t *ip = src, *anchor = src, *iend = src + n, *ref, *m;
+    u8_t *op = dst, *oend = dst + cap;
+    u32_t seq, h;
+    memset(z.hash, 0, sizeof(z.hash));
+    if(n > MFLIMIT) {
+        for(ip++; ip < iend - MFLIMIT;) {
+            seq = read32(ip);
+            h = (seq * 2654435761UL) >> (32 - SD_LZ_HASH_LOG);
+            ref = src + z.hash[h];
+            z.hash[h] = ip - src;
+            if((ip - ref > 0xffff) || (read32(ref) != seq) || (ref >= ip)) {
+                ip++;
+                continue;
+            }
+            for(m = ip + MIN_MATCH; (m < iend - LASTLITERALS)
+                    && (*m == ref[m - ip]); m++)
+                ;
+            while((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+                ip--;
+                ref--;
+            }
+            op = emit(op, oend, anchor, ip - anchor, ip - ref,
+                    m - ip - MIN_MATCH);
+            if(op == NULL)
+                return 0;
+            ip = anchor = m;
+        }
+    }
+    op = emit(op, oend, anchor, iend - anchor, 0, 0);
+    return op ? (u32_t)(op - dst) : 0;
+}
+
+static u32_t get_len(const u8_t** ip, const u8_t* iend, u32_t len, bool* err)
+{
+    u8_t b;
+    if(len == 15) {
+        do {
+            if(*ip >= iend) {
+                *err = true;
+                return 0;
+            }
+            b = *(*ip)++;
+            len += b;
+        } while(b == 255);
+    }
+    return len;
+}
+
+/* LZ4 block decoder, checks all bounds; -1 on corrupt input */
+static long lz_decode(const u8_t* src, u32_t n, u8_t* dst, u32_t cap)
+{
+    const u8_t *ip = src, *iend = src + n, *ref;
+    u8_t *op = dst, *oend = dst + cap;
+    u32_t tok, len, off;
+    bool err = false;
+    while(ip < iend) {
+        tok = *ip++;
+        len = get_len(&ip, iend, tok >> 4, &err);
+        if(err || (len > (u32_t)(iend - ip)) || (len > (u32_t)(oend - op)))
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if(ip >= iend)
+            break;      // the last sequence has literals only
+        if(iend - ip < 2)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        len = get_len(&ip, iend, tok & 15, &err) + MIN_MATCH;
+        if(err || (off == 0) || (off > (u32_t)(op - dst))
+                || (len > (u32_t)(oend - op)))
+            return -1;
+        for(ref = op - off; len; len--)
+            *op++ = *ref++;     // may overlap
+    }
+    return op - dst;
+}
+
+static SD_Error put(const void* data, u32_t n)
+{
+    SD_Error ret;
+    const u8_t* p = data;
+    u32_t k;
+    while(n) {
+        k = sizeof(z.out) - z.fill;
+        if(k > n)
+            k = n;
+        memcpy((u8_t*)z.out + z.fill, p, k);
+        z.fill += k;
+        p += k;
+        n -= k;
+        if(z.fill == sizeof(z.out)) {
+            ret = SD_WriteSectors(z.lba, z.out, SD_LZ_OUT);
+            if(ret != SD_OK)
+                return (ret);
+            z.lba += SD_LZ_OUT;
+            z.fill = 0;
+            z.st.sectors += SD_LZ_OUT;
+            z.st.writes++;
+        }
+    }
+    return SD_OK;
+}
+
+static SD_Error put_frame(void)
+{
+    SD_Error ret;
+    Hdr h = {SD_LZ_MAGIC, z.seq, z.nin, 0};
+    u32_t t0 = SD_TICKS();
+    const u8_t* payload = z.tmp;
+    h.len = lz_encode(z.in, z.nin, z.tmp, z.nin - 1);
+    if(h.len == 0) {
+        h.len = z.nin;
+        payload = z.in;
+        z.st.stored++;
+    }
+    z.st.comp_ticks += SD_TICKS() - t0;
+    ret = put(&h, HDR_SIZE);
+    if(ret == SD_OK)
+        ret = put(payload, h.len);
+    if(ret != SD_OK)
+        return (ret);
+    z.seq++;
+    z.st.frames++;
+    z.st.raw_bytes += z.nin;
+    z.st.card_bytes += HDR_SIZE + h.len;
+    z.nin = 0;
+    return SD_OK;
+}
+
+SD_Error SD_LzInit(u32_t lba, u32_t seq)
+{
+    memset(&z.st, 0, sizeof(z.st));
+    z.lba = lba;
+    z.seq = seq;
+    z.fill = z.nin = 0;
+    return SD_OK;
+}
+
+SD_Error SD_LzWrite(const void* data, u32_t len)
+{
+    SD_Error ret;
+    const u8_t* p = data;
+    u32_t k;
+    if((data == NULL) && len)
+        return SD_INVALID_PARAMETER;
+    while(len) {
+        k = SD_LZ_BLOCK - z.nin;
+        if(k > len)
+            k = len;
+        memcpy(z.in + z.nin, p, k);
+        z.nin += k;
+        p += k;
+        len -= k;
+        if(z.nin == SD_LZ_BLOCK) {
+            ret = put_frame();
+            if(ret != SD_OK)
+                return (ret);
+        }
+    }
+    return SD_OK;
+}
+
+SD_Error SD_LzFlush(void)
+{
+    SD_Error ret = SD_OK;
+    u32_t n;
+    if(z.nin)
+        ret = put_frame();
+    if((ret != SD_OK) || (z.fill == 0))
+        return (ret);
+    n = (z.fill + 511) / 512;
+    memset((u8_t*)z.out + z.fill, 0, n * 512 - z.fill);
+    ret = SD_WriteSectors(z.lba, z.out, n);
+    if(ret != SD_OK)
+        return (ret);
+    z.st.card_bytes += n * 512 - z.fill;
+    z.st.sectors += n;
+    z.st.writes++;
+    z.lba += n;
+    z.fill = 0;
+    return SD_OK;
+}
+
+SD_Error SD_LzRead(SD_LzPos* pos, void* out, u32_t* len)
+{
+    SD_Error ret;
+    Hdr h = {0};
+    u32_t hs, n, end, t0;
+    long k;
+    for(;;) {
+        hs = (pos->off + HDR_SIZE + 511) / 512;
+        ret = SD_ReadSectors(pos->lba, rd, hs);
+        if(ret != SD_OK)
+            return (ret);
+        memcpy(&h, (u8_t*)rd + pos->off, HDR_SIZE);
+        if((h.magic == SD_LZ_MAGIC) && (h.seq == pos->seq))
+            break;
+        if((pos->off == 0) || (h.magic == SD_LZ_MAGIC))
+            return SD_REQUEST_NOT_APPLICABLE;
+        pos->lba++;     // flush padding, frame on the next sector
+        pos->off = 0;
+    }
+    if((h.raw > SD_LZ_BLOCK) || (h.len > h.raw))
+        return SD_ERROR;
+    end = pos->off + HDR_SIZE + h.len;
+    n = (end + 511) / 512;
+    if(n > hs) {
+        ret = SD_ReadSectors(pos->lba + hs, rd[hs], n - hs);
+        if(ret != SD_OK)
+            return (ret);
+    }
+    t0 = SD_TICKS();
+    if(h.len == h.raw)
+        memcpy(out, (u8_t*)rd + pos->off + HDR_SIZE, h.raw);
+    else {
+        k = lz_decode((u8_t*)rd + pos->off + HDR_SIZE, h.len, out, h.raw);
+        if(k != h.raw)
+            return SD_ERROR;
+    }
+    z.st.decomp_ticks += SD_TICKS() - t0;
+    *len = h.raw;
+    pos->lba += end / 512;
+    pos->off = end % 512;
+    pos->seq++;
+    return SD_OK;
+}
+
+void SD_LzGetStats(SD_LzStats* st, bool reset)
+{
+    *st = z.st;
+    if(reset)
+        memset(&z.st, 0, sizeof(z.st));
+}
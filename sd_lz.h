@@ -0,0 +1,47 @@
+#ifndef _SD_LZ_H
+#define _SD_LZ_H
+
+#include "sdio.h"
+
+/* Compression stage in front of the sector writer. Data written with
+ * SD_LzWrite() is cut into SD_LZ_BLOCK byte blocks, each compressed into
+ * one frame in LZ4 block format (stored as is when it does not shrink).
+ * Frames are packed back to back into SD_LZ_OUT sector writes:
+ *   u32 magic "SLZ1", u32 seq, u16 raw length, u16 payload length, payload
+ * payload length == raw length: stored. SD_LzFlush() pads the current
+ * sector with zeros, the next frame starts on a sector boundary.
+ * All memory is static, about 2 * SD_LZ_BLOCK + 2^SD_LZ_HASH_LOG * 2 +
+ * SD_LZ_OUT * 512 bytes plus the reader's SD_LZ_BLOCK + 1 KiB. */
+#ifndef SD_LZ_BLOCK
+#define SD_LZ_BLOCK     4096    // bytes, < 65536
+#endif
+#ifndef SD_LZ_HASH_LOG
+#define SD_LZ_HASH_LOG  11
+#endif
+#ifndef SD_LZ_OUT
+#define SD_LZ_OUT       8       // sectors per card write
+#endif
+#define SD_LZ_MAGIC     0x315a4c53UL
+
+typedef struct {
+    unsigned long lba, off;     // frame position, off: byte in sector
+    unsigned long seq;          // expected frame sequence number
+} SD_LzPos;
+
+typedef struct {
+    unsigned long frames, stored;   // stored: frames that did not shrink
+    unsigned long raw_bytes, card_bytes;    // card_bytes incl. headers, padding
+    unsigned long sectors, writes;
+    unsigned long comp_ticks, decomp_ticks;
+} SD_LzStats;
+
+/* frames go to sectors from lba on, numbered from seq */
+SD_Error SD_LzInit(unsigned long lba, unsigned long seq);
+SD_Error SD_LzWrite(const void* data, unsigned long len);
+SD_Error SD_LzFlush(void);
+/* Next frame at pos into out (SD_LZ_BLOCK bytes), pos moves past it.
+ * SD_REQUEST_NOT_APPLICABLE: no frame with the expected seq, end of log */
+SD_Error SD_LzRead(SD_LzPos* pos, void* out, unsigned long* len);
+void SD_LzGetStats(SD_LzStats* st, bool reset);
+
+#endif
@@ -0,0 +1,74 @@
+#include "misc.h"
+#include "sd_pool.h"
+
+typedef unsigned long u32_t;
+typedef unsigned char u8_t;
+
+static u32_t slab[SD_POOL_SLABS][SD_POOL_SLAB / 4] SD_POOL_ATTR;
+
+static struct {
+    u8_t free[SD_POOL_SLABS];   // stack of released slab numbers
+    u32_t nfree, fresh;         // on the stack, never handed out yet
+    u32_t lent[(SD_POOL_SLABS + 31) / 32];
+    SD_PoolStats st;
+} p;
+
+void* SD_PoolAlloc(void)
+{
+    u32_t i, primask = __get_PRIMASK();
+    __disable_irq();
+    p.st.allocs++;
+    /* slabs not handed out yet need no stack entry, so no init call */
+    if(p.nfree)
+        i = p.free[--p.nfree];
+    else if(p.fresh < SD_POOL_SLABS)
+        i = p.fresh++;
+    else {
+        p.st.failed++;
+        __set_PRIMASK(primask);
+        return NULL;
+    }
+    p.lent[i / 32] |= 1UL << (i % 32);
+    if(++p.st.used > p.st.high_water)
+        p.st.high_water = p.st.used;
+    __set_PRIMASK(primask);
+    return slab[i];
+}
+
+bool SD_PoolOwns(const void* buff)
+{
+    u32_t off = (u32_t)buff - (u32_t)slab;
+    return (off < sizeof(slab)) && (off % SD_POOL_SLAB == 0);
+}
+
+SD_Error SD_PoolFree(void* buff)
+{
+    u32_t i, primask;
+    if(!SD_PoolOwns(buff))
+        return SD_INVALID_PARAMETER;
+    i = ((u32_t)buff - (u32_t)slab) / SD_POOL_SLAB;
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if(!(p.lent[i / 32] & (1UL << (i % 32)))) {
+        __set_PRIMASK(primask);
+        return SD_INVALID_PARAMETER;
+    }
+    p.lent[i / 32] &= ~(1UL << (i % 32));
+    p.free[p.nfree++] = i;
+    p.st.used--;
+    __set_PRIMASK(primask);
+    return SD_OK;
+}
+
+void SD_PoolGetStats(SD_PoolStats* st, bool reset)
+{
+    u32_t primask = __get_PRIMASK();
+    __disable_irq();
+    p.st.slabs = SD_POOL_SLABS;
+    *st = p.st;
+    if(reset) {
+        p.st.high_water = p.st.used;
+        p.st.allocs = p.st.failed = 0;
+    }
+    __set_PRIMASK(primask);
+}
@@ -0,0 +1,38 @@
+#ifndef _SD_POOL_H
+#define _SD_POOL_H
+
+#include "sdio.h"
+
+/* Driver owned pool of sector buffers, so callers need no static arrays of
+ * their own. Slabs are aligned to 512 bytes and live in one array that the
+ * linker script can put in RAM the DMA reaches (not the F4 CCM) through
+ * SD_POOL_SECTION. A slab is an ordinary buffer to the transfer functions,
+ * nothing is copied. Allocation and release are O(1) from a stack of free
+ * slab numbers and may be called from interrupts. */
+#ifndef SD_POOL_SLABS
+#define SD_POOL_SLABS   16      // <= 256
+#endif
+#ifndef SD_POOL_SLAB
+#define SD_POOL_SLAB    512     // bytes per slab, a multiple of 512
+#endif
+/* e.g. ".sd_dma", a section of its own placed by the linker script */
+#ifdef SD_POOL_SECTION
+#define SD_POOL_ATTR    __attribute__((section(SD_POOL_SECTION), aligned(512)))
+#else
+#define SD_POOL_ATTR    __attribute__((aligned(512)))
+#endif
+
+typedef struct {
+    unsigned long slabs, used;  // total, allocated now
+    unsigned long high_water;   // most ever allocated at once
+    unsigned long allocs, failed;   // SD_PoolAlloc() calls, that found none
+} SD_PoolStats;
+
+/* one slab of SD_POOL_SLAB bytes, NULL when all are lent */
+void* SD_PoolAlloc(void);
+/* SD_INVALID_PARAMETER for a pointer not from SD_PoolAlloc() or freed twice */
+SD_Error SD_PoolFree(void* buff);
+bool SD_PoolOwns(const void* buff);
+void SD_PoolGetStats(SD_PoolStats* st, bool reset);
+
+#endif
@@ -0,0 +1,94 @@
+#include "misc.h"
+#include "sd_raid0.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+typedef unsigned char u8_t;
+
+static struct {
+    SD_Card* card[2];
+    SD_RaidStats st;
+} r;
+
+static void use(u32_t c)
+{
+    if(SD_Selected() != r.card[c]) {
+        SD_Select(r.card[c]);
+        r.st.switches++;
+    }
+}
+
+SD_Error SD_RaidInit(SD_Card* card0, SD_Card* card1)
+{
+    if((card0 == NULL) || (card1 == NULL) || (card0 == card1))
+        return SD_INVALID_PARAMETER;
+    r.card[0] = card0;
+    r.card[1] = card1;
+    memset(&r.st, 0, sizeof(r.st));
+    return SD_OK;
+}
+
+/* split [lba, lba + nblocks) at stripe boundaries, alternating cards */
+static SD_Error stripe(bool write, u32_t lba, u8_t* p, u32_t nblocks)
+{
+    SD_Error ret = SD_OK;
+    u32_t k, c, off, n;
+    bool posted;
+    while(nblocks && (ret == SD_OK)) {
+        k = lba / SD_RAID_STRIPE;
+        off = lba % SD_RAID_STRIPE;
+        c = k & 1;
+        n = SD_RAID_STRIPE - off;
+        if(n > nblocks)
+            n = nblocks;
+        use(c);
+        if(write) {
+            posted = SD_SetPostedWrites(true);
+            ret = SD_WriteSectors((k >> 1) * SD_RAID_STRIPE + off, p, n);
+            SD_SetPostedWrites(posted);
+        }
+        else
+            ret = SD_ReadSectors((k >> 1) * SD_RAID_STRIPE + off, p, n);
+        r.st.sectors[c] += n;
+        lba += n;
+        p += n * 512;
+        nblocks -= n;
+    }
+    return (ret);
+}
+
+SD_Error SD_RaidWrite(u32_t lba, const void* buff, u32_t nblocks)
+{
+    if((buff == NULL) || (nblocks == 0))
+        return SD_INVALID_PARAMETER;
+    return stripe(true, lba, (u8_t*)buff, nblocks);
+}
+
+SD_Error SD_RaidRead(u32_t lba, void* buff, u32_t nblocks)
+{
+    if((buff == NULL) || (nblocks == 0))
+        return SD_INVALID_PARAMETER;
+    return stripe(false, lba, buff, nblocks);
+}
+
+SD_Error SD_RaidFlush(void)
+{
+    SD_Error ret = SD_OK;
+    bool busy;
+    u32_t c;
+    for(c = 0; (c < 2) && (ret == SD_OK); c++) {
+        use(c);
+        do {
+            ret = SD_CardBusy(&busy);
+        } while((ret == SD_OK) && busy);
+    }
+    return (ret);
+}
+
+void SD_RaidGetStats(SD_RaidStats* st, bool reset)
+{
+    *st = r.st;
+    if(reset)
+        memset(&r.st, 0, sizeof(r.st));
+}
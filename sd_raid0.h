@@ -0,0 +1,34 @@
+#ifndef _SD_RAID0_H
+#define _SD_RAID0_H
+
+#include "sdio.h"
+
+/* RAID-0 over two cards (SD_CardAttach). Sectors are striped in units of
+ * SD_RAID_STRIPE, stripe k lives on card k % 2. Writes are posted, so one
+ * card programs a stripe while the next goes over the bus to the other;
+ * with a single controller that programming time is what overlaps.
+ * Reads are striped only because the data is: the one bus carries either
+ * card's data, so they run one stripe after the other, a card switch and
+ * a command more per stripe than on one card.
+ * The cards' own posted write setting is kept for other callers.
+ * Both cards must be initialized; the layer leaves either one selected.
+ * tools/sd_sim.c -r runs it against two simulated cards.
+ * All addresses are in 512 byte sectors. */
+#ifndef SD_RAID_STRIPE
+#define SD_RAID_STRIPE  64  // sectors, 32 KiB
+#endif
+
+typedef struct {
+    unsigned long sectors[2];   // per card
+    unsigned long switches;     // card selections
+} SD_RaidStats;
+
+SD_Error SD_RaidInit(SD_Card* card0, SD_Card* card1);
+SD_Error SD_RaidWrite(unsigned long lba, const void* buff,
+        unsigned long nblocks);
+SD_Error SD_RaidRead(unsigned long lba, void* buff, unsigned long nblocks);
+/* wait until both cards finished programming */
+SD_Error SD_RaidFlush(void);
+void SD_RaidGetStats(SD_RaidStats* st, bool reset);
+
+#endif
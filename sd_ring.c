@@ -0,0 +1,78 @@
+#include "misc.h"
+#include "sd_ring.h"
+
+typedef unsigned long u32_t;
+
+SD_Error SD_RingInit(SD_Ring* r, void* storage, u32_t nsectors, u32_t lba,
+        u32_t count)
+{
+    if((r == NULL) || (storage == NULL) || ((u32_t)storage & 511)
+            || (nsectors == 0) || (nsectors & (nsectors - 1))
+            || (count == 0) || (lba + count < lba))
+        return SD_INVALID_PARAMETER;
+    r->sector = storage;
+    r->mask = nsectors - 1;
+    r->head = r->tail = 0;
+    r->lba = lba;
+    r->end = lba + count;
+    r->overflow = r->high_water = r->drained = r->runs = 0;
+    return SD_OK;
+}
+
+void* SD_RingAcquire(SD_Ring* r)
+{
+    u32_t head = r->head;
+    if(head - r->tail > r->mask) {
+        r->overflow++;
+        return NULL;
+    }
+    return r->sector[head & r->mask];
+}
+
+void SD_RingCommit(SD_Ring* r)
+{
+    u32_t head = r->head + 1, level;
+    /* sector contents must be visible before the consumer sees head move */
+    __DMB();
+    r->head = head;
+    level = head - r->tail;
+    if(level > r->high_water)
+        r->high_water = level;
+}
+
+SD_Error SD_RingDrain(SD_Ring* r, u32_t max)
+{
+    SD_Error ret = SD_OK;
+    u32_t tail = r->tail, n, i;
+    u32_t avail = r->head - tail;
+    __DMB();    // read the sectors only after head
+    if(max && (avail > max))
+        avail = max;
+    while(avail && (ret == SD_OK)) {
+        /* a run ends at the end of the storage, the rest wraps around */
+        i = tail & r->mask;
+        n = r->mask + 1 - i;
+        if(n > avail)
+            n = avail;
+        if(n > r->end - r->lba)
+            n = r->end - r->lba;
+        if(n == 0)
+            return SD_ADDR_OUT_OF_RANGE;
+        ret = SD_WriteSectors(r->lba, r->sector[i], n);
+        if(ret != SD_OK)
+            break;
+        r->lba += n;
+        r->drained += n;
+        r->runs++;
+        tail += n;
+        avail -= n;
+        __DMB();    // DMA done reading before the producer may reuse it
+        r->tail = tail;
+    }
+    return (ret);
+}
+
+u32_t SD_RingLevel(const SD_Ring* r)
+{
+    return r->head - r->tail;
+}
@@ -0,0 +1,35 @@
+#ifndef _SD_RING_H
+#define _SD_RING_H
+
+#include "sdio.h"
+
+/* Lock-free single producer / single consumer ring of 512 byte sectors
+ * feeding the card. The producer (typically an ISR) fills a sector in place
+ * and commits it, the writer task drains runs of committed sectors to
+ * consecutive card sectors straight from the ring, no copy is made.
+ * head is only written by the producer, tail only by the consumer.
+ * Use one ring per producer. */
+typedef struct {
+    unsigned long (*sector)[128];   // storage, 512 byte aligned
+    unsigned long mask;             // sectors - 1
+    volatile unsigned long head, tail;  // free running sector counts
+    unsigned long lba;              // card sector for the next drained one
+    unsigned long end;              // card sector after the region
+    unsigned long overflow;     // SD_RingAcquire() calls that found it full
+    unsigned long high_water;   // most sectors ever committed and not drained
+    unsigned long drained, runs;    // sectors written, transfers used
+} SD_Ring;
+
+/* storage: nsectors * 512 bytes, 512 byte aligned, nsectors a power of
+ * two; drains to the count card sectors from lba */
+SD_Error SD_RingInit(SD_Ring* r, void* storage, unsigned long nsectors,
+        unsigned long lba, unsigned long count);
+/* producer side: free sector to fill, NULL if the ring is full */
+void* SD_RingAcquire(SD_Ring* r);
+void SD_RingCommit(SD_Ring* r);
+/* consumer side: write up to max committed sectors (0: all);
+ * SD_ADDR_OUT_OF_RANGE once the region is full, the rest stays queued */
+SD_Error SD_RingDrain(SD_Ring* r, unsigned long max);
+unsigned long SD_RingLevel(const SD_Ring* r);
+
+#endif
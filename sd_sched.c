@@ -0,0 +1,191 @@
+#include "misc.h"
+#include "sd_sched.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+typedef long s32_t;
+
+static struct {
+    SD_Req* head;    // arrival order
+    SD_Req* cur;     // write whose slices let reads through
+    u32_t pos;       // sector after the last dispatched request
+    SD_SchedStats st;
+} s;
+
+static u32_t due(const SD_Req* req)
+{
+    return req->submitted + SD_TICKS_PER_MS * (req->deadline ? req->deadline :
+            req->write ? SD_SCHED_WRITE_DEADLINE : SD_SCHED_READ_DEADLINE);
+}
+
+SD_Error SD_SchedSubmit(SD_Req* req)
+{
+    SD_Req** pp;
+    u32_t primask;
+    if((req == NULL) || (req->buff == NULL) || (req->nblocks == 0))
+        return SD_INVALID_PARAMETER;
+    req->next = NULL;
+    req->ret = SD_REQUEST_PENDING;
+    req->submitted = SD_TICKS();
+    primask = __get_PRIMASK();
+    __disable_irq();
+    for(pp = &s.head; *pp; pp = &(*pp)->next)
+        ;
+    *pp = req;
+    if(++s.st.depth > s.st.max_depth)
+        s.st.max_depth = s.st.depth;
+    __set_PRIMASK(primask);
+    return SD_OK;
+}
+
+/* overlapping sectors where either one writes: out of order, a read
+ * would miss the write's data or get it too early, and of two writes the
+ * older would win */
+static bool overlap(const SD_Req* a, const SD_Req* b)
+{
+    return (a->write || b->write) && (a->lba < b->lba + b->nblocks)
+            && (b->lba < a->lba + a->nblocks);
+}
+
+/* the oldest queued request before *pp it must wait for, NULL if none */
+static SD_Req** conflict(SD_Req** pp)
+{
+    SD_Req** o;
+    for(o = &s.head; *o != *pp; o = &(*o)->next) {
+        if(overlap(*o, *pp))
+            return o;
+    }
+    return NULL;
+}
+
+/* waits for a queued request or for the write in progress, part of
+ * which may not be on the card yet */
+static bool blocked(SD_Req** pp)
+{
+    return conflict(pp) || (s.cur && overlap(s.cur, *pp));
+}
+
+/* choose and unlink the next request, NULL if the queue is empty */
+static SD_Req* pick(u32_t now, bool reads_only)
+{
+    SD_Req **pp, **expired = NULL, **up = NULL, **low = NULL, **o;
+    bool reads = false;
+    for(pp = &s.head; *pp; pp = &(*pp)->next) {
+        if(((s32_t)(now - due(*pp)) >= 0)
+                && (!expired || ((s32_t)(due(*pp) - due(*expired)) < 0)))
+            expired = pp;
+        reads |= !(*pp)->write && !blocked(pp);
+    }
+    if(reads_only && !reads)
+        return NULL;
+    while(expired && (o = conflict(expired)))  // what it waits for goes first
+        expired = o;
+    if(expired && s.cur && overlap(s.cur, *expired))
+        expired = NULL;
+    if(expired && !(reads_only && (*expired)->write)) {
+        s.st.expired++;
+        pp = expired;
+    }
+    else {
+        for(pp = &s.head; *pp; pp = &(*pp)->next) {
+            if(((*pp)->write && reads) || blocked(pp))
+                continue;
+            if(((*pp)->lba >= s.pos) && (!up || ((*pp)->lba < (*up)->lba)))
+                up = pp;
+            if(!low || ((*pp)->lba < (*low)->lba))
+                low = pp;
+        }
+        pp = up ? up : low;
+    }
+    if(pp == NULL)
+        return NULL;
+    SD_Req* req = *pp;
+    *pp = req->next;
+    return req;
+}
+
+static void serve_reads(void);
+
+static SD_Error dispatch(bool reads_only)
+{
+    SD_Req* req;
+    u32_t primask, now = SD_TICKS(), wait;
+    primask = __get_PRIMASK();
+    __disable_irq();
+    req = pick(now, reads_only);
+    if(req) {
+        s.st.depth_sum += s.st.depth;
+        s.st.depth--;
+    }
+    __set_PRIMASK(primask);
+    if(req == NULL)
+        return SD_REQUEST_NOT_APPLICABLE;
+    wait = now - req->submitted;
+    s.st.dispatched++;
+    s.st.count[req->write]++;
+    s.st.wait_sum[req->write] += wait;
+    if(wait > s.st.wait_max[req->write])
+        s.st.wait_max[req->write] = wait;
+    s.pos = req->lba + req->nblocks;
+    if(req->write) {    // the yield hook only for the scheduler's own writes
+        void (*yield)(void) = SD_SetWriteYield(serve_reads);
+        s.cur = req;
+        req->ret = SD_WriteSectors(req->lba, req->buff, req->nblocks);
+        s.cur = NULL;
+        SD_SetWriteYield(yield);
+    }
+    else
+        req->ret = SD_ReadSectors(req->lba, req->buff, req->nblocks);
+    return req->ret;
+}
+
+/* write yield hook: reads that arrived meanwhile preempt the bulk write */
+static void serve_reads(void)
+{
+    while(dispatch(true) != SD_REQUEST_NOT_APPLICABLE)
+        s.st.preempted++;
+}
+
+/* Serve one request. SD_REQUEST_NOT_APPLICABLE: nothing queued, otherwise
+ * the result of the request served */
+SD_Error SD_SchedDispatch(void)
+{
+    return dispatch(false);
+}
+
+static SD_Error sched_sync(SD_Req* req)
+{
+    SD_Error ret = SD_SchedSubmit(req);
+    if(ret != SD_OK)
+        return (ret);
+    while(req->ret == SD_REQUEST_PENDING)
+        SD_SchedDispatch();
+    return req->ret;
+}
+
+/* blocking helpers for the task that also dispatches */
+SD_Error SD_SchedRead(u32_t lba, void* buff, u32_t nblocks)
+{
+    SD_Req req = {NULL, lba, nblocks, buff, false};
+    return sched_sync(&req);
+}
+
+SD_Error SD_SchedWrite(u32_t lba, const void* buff, u32_t nblocks)
+{
+    SD_Req req = {NULL, lba, nblocks, (void*)buff, true};
+    return sched_sync(&req);
+}
+
+void SD_SchedGetStats(SD_SchedStats* st, bool reset)
+{
+    u32_t primask = __get_PRIMASK();
+    __disable_irq();
+    *st = s.st;
+    if(reset) {
+        u32_t depth = s.st.depth;
+        memset(&s.st, 0, sizeof(s.st));
+        s.st.depth = s.st.max_depth = depth;
+    }
+    __set_PRIMASK(primask);
+}
@@ -0,0 +1,50 @@
+#ifndef _SD_SCHED_H
+#define _SD_SCHED_H
+
+#include "sdio.h"
+
+/* Deadline / elevator scheduler in front of the sector transfers.
+ * Requests from several tasks are queued with SD_SchedSubmit() and served
+ * by SD_SchedDispatch(), called from the task that owns the card:
+ *  - a request past its deadline is served first, earliest deadline wins
+ *  - otherwise reads go before writes
+ *  - within a class, ascending LBA from the last position, wrapping
+ *    around to the lowest (C-LOOK)
+ *  - none of this passes an older request to overlapping sectors where
+ *    either one writes, that one is served first
+ *  - writes longer than SD_WRITE_SLICE blocks stop at slice boundaries to
+ *    let queued reads through, then resume; reads of sectors the write
+ *    covers wait for it. The driver's write yield hook is set for this
+ *    and put back around each such write. */
+#ifndef SD_SCHED_READ_DEADLINE
+#define SD_SCHED_READ_DEADLINE      50  // ms
+#endif
+#ifndef SD_SCHED_WRITE_DEADLINE
+#define SD_SCHED_WRITE_DEADLINE     500 // ms
+#endif
+
+typedef struct SD_Req {
+    struct SD_Req* next;
+    unsigned long lba, nblocks;
+    void* buff;
+    bool write;
+    unsigned long deadline;    // ms, 0: class default
+    unsigned long submitted;   // SD_TICKS(), set by SD_SchedSubmit
+    volatile SD_Error ret;     // SD_REQUEST_PENDING until served
+} SD_Req;
+
+typedef struct {
+    unsigned long dispatched, expired;  // expired: served for its deadline
+    unsigned long preempted;    // reads served in the middle of a long write
+    unsigned long depth, max_depth, depth_sum;  // depth_sum / dispatched: mean
+    unsigned long count[2], wait_sum[2], wait_max[2];  // [0] read, [1] write, ticks
+} SD_SchedStats;
+
+SD_Error SD_SchedSubmit(SD_Req* req);
+SD_Error SD_SchedDispatch(void);
+SD_Error SD_SchedRead(unsigned long lba, void* buff, unsigned long nblocks);
+SD_Error SD_SchedWrite(unsigned long lba, const void* buff,
+        unsigned long nblocks);
+void SD_SchedGetStats(SD_SchedStats* st, bool reset);
+
+#endif
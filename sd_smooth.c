@@ -0,0 +1,136 @@
+#include "misc.h"
+#include "sd_smooth.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+typedef unsigned char u8_t;
+
+#define MASK    (SD_SMOOTH_SECTORS - 1)
+
+static struct {
+    volatile u32_t head, tail;  // head: SD_SmoothWrite, tail: SD_SmoothPoll
+    bool busy;                  // a posted write may still be programming
+    u32_t posted;               // SD_TICKS() when it went out
+    SD_SmoothStats st;
+    u32_t lba[SD_SMOOTH_SECTORS];
+    u32_t buf[SD_SMOOTH_SECTORS][128];
+} m;
+
+SD_Error SD_SmoothInit(void)
+{
+    m.head = m.tail = 0;
+    m.busy = false;
+    memset(&m.st, 0, sizeof(m.st));
+    return SD_OK;
+}
+
+SD_Error SD_SmoothWrite(u32_t lba, const void* buff, u32_t nblocks)
+{
+    u32_t t0 = SD_TICKS(), head = m.head, level = head - m.tail, i;
+    if((buff == NULL) || (nblocks == 0) || (nblocks > SD_SMOOTH_HIGH))
+        return SD_INVALID_PARAMETER;
+    if(level + nblocks > SD_SMOOTH_HIGH) {
+        m.st.rejected++;
+        return SD_REQUEST_PENDING;
+    }
+    for(i = 0; i < nblocks; i++, head++) {
+        memcpy(m.buf[head & MASK], (const u8_t*)buff + i * 512, 512);
+        m.lba[head & MASK] = lba + i;
+    }
+    __DMB();    // sectors before head
+    m.head = head;
+    if(level + nblocks > m.st.high_water)
+        m.st.high_water = level + nblocks;
+    t0 = SD_TICKS() - t0;
+    if(t0 > m.st.submit_max)
+        m.st.submit_max = t0;
+    return SD_OK;
+}
+
+SD_Error SD_SmoothPoll(void)
+{
+    SD_Error ret = SD_OK;
+    bool busy, posted;
+    u32_t tail = m.tail, avail = m.head - tail, i, n, t;
+    __DMB();
+    if(m.busy) {
+        /* programming time resolution is the poll interval */
+        ret = SD_CardBusy(&busy);
+        if(ret != SD_OK)
+            return (ret);
+        if(busy)
+            return SD_REQUEST_PENDING;
+        m.busy = false;
+        t = SD_TICKS() - m.posted;
+        if(t > m.st.prog_max)
+            m.st.prog_max = t;
+        if(t >= SD_SMOOTH_STALL_MS * SD_TICKS_PER_MS) {
+            m.st.stalls++;
+            m.st.stall_sum += t;
+        }
+    }
+    if(avail == 0)
+        return SD_OK;
+    /* longest run of consecutive sectors up to the end of the buffer */
+    i = tail & MASK;
+    for(n = 1; (n < avail) && (i + n <= MASK) && (m.lba[i + n] == m.lba[i] + n);
+            n++)
+        ;
+    posted = SD_SetPostedWrites(true);     // only for the smoothed writes
+    ret = SD_WriteSectors(m.lba[i], m.buf[i], n);
+    SD_SetPostedWrites(posted);
+    if(ret != SD_OK)
+        return (ret);   // the run stays queued
+    m.busy = true;
+    m.posted = SD_TICKS();
+    m.st.written += n;
+    m.st.runs++;
+    __DMB();    // data sent before the space is given back
+    m.tail = tail + n;
+    return SD_REQUEST_PENDING;
+}
+
+/* reads the card, then overlays sectors still in the buffer; a read waits
+ * for the programming of the last posted write */
+SD_Error SD_SmoothRead(u32_t lba, void* buff, u32_t nblocks)
+{
+    SD_Error ret;
+    u32_t t, head = m.head, k;
+    if((buff == NULL) || (nblocks == 0))
+        return SD_INVALID_PARAMETER;
+    ret = SD_ReadSectors(lba, buff, nblocks);
+    if(ret != SD_OK)
+        return (ret);
+    __DMB();
+    for(t = m.tail; t != head; t++) {
+        k = m.lba[t & MASK] - lba;
+        if(k < nblocks)
+            memcpy((u8_t*)buff + k * 512, m.buf[t & MASK], 512);
+    }
+    return SD_OK;
+}
+
+SD_Error SD_SmoothFlush(void)
+{
+    SD_Error ret;
+    do {
+        ret = SD_SmoothPoll();
+    } while(ret == SD_REQUEST_PENDING);
+    return (ret);
+}
+
+u32_t SD_SmoothLevel(void)
+{
+    return m.head - m.tail;
+}
+
+void SD_SmoothGetStats(SD_SmoothStats* st, bool reset)
+{
+    u32_t primask = __get_PRIMASK();
+    __disable_irq();
+    *st = m.st;
+    if(reset)
+        memset(&m.st, 0, sizeof(m.st));
+    __set_PRIMASK(primask);
+}
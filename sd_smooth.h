@@ -0,0 +1,44 @@
+#ifndef _SD_SMOOTH_H
+#define _SD_SMOOTH_H
+
+#include "sdio.h"
+
+/* RAM buffered writes that hide card programming stalls. SD_SmoothWrite()
+ * only copies into the buffer, so submit time is bounded by a memcpy. The
+ * background task calls SD_SmoothPoll(), which sends queued sectors as
+ * posted writes and never waits for the card to finish programming.
+ * Above SD_SMOOTH_HIGH buffered sectors writes are refused with
+ * SD_REQUEST_PENDING (back-pressure) instead of blocking.
+ * SD_SmoothWrite() may run in another task or an ISR than the poller,
+ * SD_SmoothPoll/Read/Flush belong to the task that owns the card.
+ * All addresses are in 512 byte sectors. */
+#ifndef SD_SMOOTH_SECTORS
+#define SD_SMOOTH_SECTORS   64  /* 32 KiB of RAM, power of two */
+#endif
+#ifndef SD_SMOOTH_HIGH
+#define SD_SMOOTH_HIGH      (SD_SMOOTH_SECTORS * 7 / 8)
+#endif
+#ifndef SD_SMOOTH_STALL_MS
+#define SD_SMOOTH_STALL_MS  20  // longer programming counts as a stall
+#endif
+
+typedef struct {
+    unsigned long written, runs;    // sectors, posted writes
+    unsigned long rejected;         // writes refused by back-pressure
+    unsigned long high_water;       // most sectors buffered
+    unsigned long submit_max;       // ticks spent in SD_SmoothWrite
+    unsigned long stalls, stall_sum;    // ticks
+    unsigned long prog_max;         // longest programming seen, ticks
+} SD_SmoothStats;
+
+SD_Error SD_SmoothInit(void);
+SD_Error SD_SmoothWrite(unsigned long lba, const void* buff,
+        unsigned long nblocks);
+/* SD_OK: buffer empty and card idle, SD_REQUEST_PENDING: work left */
+SD_Error SD_SmoothPoll(void);
+SD_Error SD_SmoothRead(unsigned long lba, void* buff, unsigned long nblocks);
+SD_Error SD_SmoothFlush(void);
+unsigned long SD_SmoothLevel(void);
+void SD_SmoothGetStats(SD_SmoothStats* st, bool reset);
+
+#endif
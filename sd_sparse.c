@@ -0,0 +1,262 @@
+#include "misc.h"
+#include "sd_sparse.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+typedef unsigned char u8_t;
+
+#define SPARSE_MAGIC    0x53505331UL    // "SPS1"
+
+/* the map sector as stored */
+typedef struct {
+    u32_t magic, n;
+    u32_t ext[SD_SPARSE_EXTENTS][2];    // sorted, [start, end) sectors
+    u32_t crc;
+} Map;
+
+static struct {
+    u32_t meta;
+    Map m;
+    SD_SparseStats st;
+    u32_t buf[128];
+} sp;
+
+static void drop(u32_t i)
+{
+    memmove(sp.m.ext[i], sp.m.ext[i + 1], (sp.m.n - i - 1) * sizeof(sp.m.ext[0]));
+    sp.m.n--;
+}
+
+static void insert(u32_t start, u32_t end)
+{
+    u32_t i, small = 0;
+    if(sp.m.n == SD_SPARSE_EXTENTS) {
+        for(i = 1; i < sp.m.n; i++)
+            if(sp.m.ext[i][1] - sp.m.ext[i][0]
+                    < sp.m.ext[small][1] - sp.m.ext[small][0])
+                small = i;
+        sp.st.dropped++;
+        if(end - start <= sp.m.ext[small][1] - sp.m.ext[small][0])
+            return;
+        drop(small);
+    }
+    for(i = sp.m.n; (i > 0) && (sp.m.ext[i - 1][0] > start); i--) {
+        sp.m.ext[i][0] = sp.m.ext[i - 1][0];
+        sp.m.ext[i][1] = sp.m.ext[i - 1][1];
+    }
+    sp.m.ext[i][0] = start;
+    sp.m.ext[i][1] = end;
+    sp.m.n++;
+}
+
+/* add [start, end), merged with overlapping and adjacent extents */
+static void add(u32_t start, u32_t end)
+{
+    u32_t i = 0;
+    while(i < sp.m.n) {
+        if((sp.m.ext[i][0] <= end) && (sp.m.ext[i][1] >= start)) {
+            if(sp.m.ext[i][0] < start)
+                start = sp.m.ext[i][0];
+            if(sp.m.ext[i][1] > end)
+                end = sp.m.ext[i][1];
+            drop(i);
+        }
+        else
+            i++;
+    }
+    insert(start, end);
+}
+
+/* take [start, end) out, true if the map changed */
+static bool cut(u32_t start, u32_t end)
+{
+    u32_t i = 0, a, b;
+    bool changed = false;
+    while(i < sp.m.n) {
+        a = sp.m.ext[i][0];
+        b = sp.m.ext[i][1];
+        if((a >= end) || (b <= start)) {
+            i++;
+            continue;
+        }
+        changed = true;
+        drop(i);
+        if(a < start)
+            insert(a, start);
+        if(b > end)
+            insert(end, b);
+        i = 0;  // insert() may have reordered
+        while((i < sp.m.n) && (sp.m.ext[i][1] <= start))
+            i++;
+    }
+    return changed;
+}
+
+static SD_Error save(void)
+{
+    sp.m.magic = SPARSE_MAGIC;
+    sp.m.crc = SD_CRC32(&sp.m, offsetof(Map, crc) / 4);
+    memset(sp.buf, 0, sizeof(sp.buf));
+    memcpy(sp.buf, &sp.m, sizeof(sp.m));
+    sp.st.saves++;
+    return SD_WriteSectors(sp.meta, sp.buf, 1);
+}
+
+SD_Error SD_SparseInit(u32_t meta_lba)
+{
+    SD_Error ret;
+    SD_CRC_CLOCK_ON();
+    memset(&sp.st, 0, sizeof(sp.st));
+    sp.meta = meta_lba;
+    ret = SD_ReadSectors(meta_lba, sp.buf, 1);
+    if(ret != SD_OK)
+        return (ret);
+    memcpy(&sp.m, sp.buf, sizeof(sp.m));
+    if((sp.m.magic != SPARSE_MAGIC) || (sp.m.n > SD_SPARSE_EXTENTS)
+            || (sp.m.crc != SD_CRC32(&sp.m, offsetof(Map, crc) / 4)))
+        sp.m.n = 0;     // no map yet, nothing known to be erased
+    return SD_OK;
+}
+
+SD_Error SD_SparseErase(u32_t lba, u32_t nblocks)
+{
+    SD_Error ret;
+    if(nblocks == 0)
+        return SD_INVALID_PARAMETER;
+    ret = SD_EraseSectors(lba, lba + nblocks - 1);
+    if(ret != SD_OK)
+        return (ret);
+    sp.st.erased += nblocks;
+    add(lba, lba + nblocks);
+    return save();
+}
+
+/* true if all 512 bytes are fill, a word at a time with early exit */
+static bool is_fill(const u32_t* p, u8_t fill)
+{
+    u32_t w = fill * 0x01010101UL, i;
+    for(i = 0; i < 128; i += 8) {
+        if((p[i] ^ w) | (p[i + 1] ^ w) | (p[i + 2] ^ w) | (p[i + 3] ^ w)
+                | (p[i + 4] ^ w) | (p[i + 5] ^ w) | (p[i + 6] ^ w)
+                | (p[i + 7] ^ w))
+            return false;
+    }
+    return true;
+}
+
+static SD_Error write_run(u32_t lba, const void* buff, u32_t nblocks)
+{
+    SD_Error ret;
+    /* the map must not claim erased sectors that hold data, save first */
+    if(cut(lba, lba + nblocks)) {
+        ret = save();
+        if(ret != SD_OK)
+            return (ret);
+    }
+    return SD_WriteSectors(lba, buff, nblocks);
+}
+
+/* blocks that already read as erased: nothing to write if the map knows */
+static SD_Error fill_run(u32_t lba, const void* buff, u32_t nblocks)
+{
+    if(nblocks == 0)
+        return SD_OK;
+    if(SD_SparseIsErased(lba, nblocks)) {
+        sp.st.skipped += nblocks;
+        return SD_OK;
+    }
+    return write_run(lba, buff, nblocks);
+}
+
+/* Runs of blocks with the erased content become erases of the whole erase
+ * units inside them (AU, or SD_SPARSE_ERASE_MIN when unknown), the ends
+ * are written unless already known erased. */
+SD_Error SD_SparseWrite(u32_t lba, const void* buff, u32_t nblocks)
+{
+    SD_Error ret = SD_OK;
+    const u8_t* p = buff;
+    u8_t fill = SD_ErasedByte();
+    u32_t n, s, e, unit = SD_GetAUSize() * 2;
+    if((buff == NULL) || (nblocks == 0))
+        return SD_INVALID_PARAMETER;
+    if((u32_t)buff & 3)
+        return write_run(lba, buff, nblocks);
+    if(unit == 0)
+        unit = SD_SPARSE_ERASE_MIN;
+    while(nblocks && (ret == SD_OK)) {
+        for(n = 0; (n < nblocks) && is_fill((const u32_t*)(p + n * 512), fill);
+                n++)
+            ;
+        if(n == 0) {
+            for(n = 1; (n < nblocks)
+                    && !is_fill((const u32_t*)(p + n * 512), fill); n++)
+                ;
+            ret = write_run(lba, p, n);
+        }
+        else {
+            s = (lba + unit - 1) / unit * unit;
+            e = (lba + n) / unit * unit;
+            if(s < e) {
+                ret = fill_run(lba, p, s - lba);
+                if(ret == SD_OK)
+                    ret = SD_SparseErase(s, e - s);
+                if(ret == SD_OK)
+                    ret = fill_run(e, p + (e - lba) * 512, lba + n - e);
+                sp.st.converted += e - s;
+            }
+            else
+                ret = fill_run(lba, p, n);
+        }
+        lba += n;
+        p += n * 512;
+        nblocks -= n;
+    }
+    return (ret);
+}
+
+SD_Error SD_SparseRead(u32_t lba, void* buff, u32_t nblocks)
+{
+    SD_Error ret;
+    u8_t* p = buff;
+    u32_t end = lba + nblocks, i, n;
+    if((buff == NULL) || (nblocks == 0))
+        return SD_INVALID_PARAMETER;
+    while(lba < end) {
+        for(i = 0; (i < sp.m.n) && (sp.m.ext[i][1] <= lba); i++)
+            ;
+        if((i < sp.m.n) && (sp.m.ext[i][0] <= lba)) {
+            n = ((sp.m.ext[i][1] < end) ? sp.m.ext[i][1] : end) - lba;
+            memset(p, SD_ErasedByte(), n * 512);
+            sp.st.filled += n;
+        }
+        else {
+            n = ((i < sp.m.n) && (sp.m.ext[i][0] < end) ? sp.m.ext[i][0] : end)
+                    - lba;
+            ret = SD_ReadSectors(lba, p, n);
+            if(ret != SD_OK)
+                return (ret);
+            sp.st.read += n;
+        }
+        lba += n;
+        p += n * 512;
+    }
+    return SD_OK;
+}
+
+bool SD_SparseIsErased(u32_t lba, u32_t nblocks)
+{
+    u32_t i;
+    for(i = 0; i < sp.m.n; i++)
+        if((sp.m.ext[i][0] <= lba) && (sp.m.ext[i][1] >= lba + nblocks))
+            return true;
+    return false;
+}
+
+void SD_SparseGetStats(SD_SparseStats* st, bool reset)
+{
+    *st = sp.st;
+    if(reset)
+        memset(&sp.st, 0, sizeof(sp.st));
+}
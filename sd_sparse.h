@@ -0,0 +1,42 @@
+#ifndef _SD_SPARSE_H
+#define _SD_SPARSE_H
+
+#include "sdio.h"
+
+/* Map of sector ranges known to be erased. Reads of mapped sectors are
+ * filled with SD_ErasedByte() in memory, only the rest goes to the card.
+ * SD_SparseErase() adds to the map, SD_SparseWrite() takes written sectors
+ * out before the data goes to the card. SD_SparseWrite() also turns runs
+ * of blocks holding only the erased content into erases, and skips them
+ * where the map already knows them erased. The map is kept in one reserved
+ * sector and saved on every change; when it runs out of extents the
+ * smallest is forgotten, which only costs card reads.
+ * The layer must be the only writer of the sectors it maps: the driver
+ * does not tell it of writes, so a sector written with SD_WriteSectors()
+ * or by another layer while mapped still reads as erased.
+ * All addresses are in 512 byte sectors. */
+#ifndef SD_SPARSE_ERASE_MIN
+#define SD_SPARSE_ERASE_MIN 64  // erase unit in sectors when the AU is unknown
+#endif
+#ifndef SD_SPARSE_EXTENTS
+#define SD_SPARSE_EXTENTS   32  // <= 62, one sector
+#endif
+
+typedef struct {
+    unsigned long filled, read;     // sectors from memory, from the card
+    unsigned long erased, saves;    // sectors erased, map sector writes
+    unsigned long dropped;          // extents forgotten for lack of room
+    unsigned long converted;        // uniform sectors erased, not written
+    unsigned long skipped;          // uniform sectors already erased
+} SD_SparseStats;
+
+/* map in sector meta_lba, which must lie outside the area used */
+SD_Error SD_SparseInit(unsigned long meta_lba);
+SD_Error SD_SparseErase(unsigned long lba, unsigned long nblocks);
+SD_Error SD_SparseWrite(unsigned long lba, const void* buff,
+        unsigned long nblocks);
+SD_Error SD_SparseRead(unsigned long lba, void* buff, unsigned long nblocks);
+bool SD_SparseIsErased(unsigned long lba, unsigned long nblocks);
+void SD_SparseGetStats(SD_SparseStats* st, bool reset);
+
+#endif
@@ -0,0 +1,193 @@
+#include "misc.h"
+#include "sd_stress.h"
+
+#ifdef SD_FAULT_INJECT
+
+typedef unsigned long u32_t;
+typedef unsigned char u8_t;
+
+#define WORDS   (512 / sizeof(u32_t))   // per sector, u32_t is 64 bit on a host
+
+static struct {
+    u32_t buf[SD_STRESS_MAX][WORDS];
+    u32_t rand, salt, busy_ticks;
+    u32_t armed;            // class injected at the next check, or CLASSES
+    u32_t fired;            // when it was
+    bool hit, busy, write;  // injected, busy period running, request dir
+} s;
+
+/* xorshift32, the same sequence where unsigned long is wider */
+static u32_t Rand(void)
+{
+    s.rand ^= (s.rand << 13) & 0xffffffffUL;
+    s.rand ^= s.rand >> 17;
+    s.rand ^= (s.rand << 5) & 0xffffffffUL;
+    return s.rand;
+}
+
+static u32_t Pattern(u32_t lba, u32_t i)
+{
+    return (lba ^ s.salt) * 0x9E3779B1UL + i * 0x85EBCA77UL;
+}
+
+static void Fill(u32_t lba, u32_t n)
+{
+    for(u32_t i = 0; i < n; i++)
+        for(u32_t j = 0; j < WORDS; j++)
+            s.buf[i][j] = Pattern(lba + i, j);
+}
+
+/* sectors of the buffer that are not what lba..lba + n - 1 must hold */
+static u32_t Check(u32_t lba, u32_t n)
+{
+    u32_t bad = 0;
+    for(u32_t i = 0; i < n; i++) {
+        for(u32_t j = 0; j < WORDS; j++) {
+            if(s.buf[i][j] != Pattern(lba + i, j)) {
+                bad++;
+                break;
+            }
+        }
+    }
+    return (bad);
+}
+
+static void Fire(void)
+{
+    s.armed = SD_STRESS_CLASSES;
+    s.fired = SD_TICKS();
+    s.hit = true;
+}
+
+static u32_t Hook(u8_t at, u32_t sta)
+{
+    u32_t cls = s.armed;
+    if(at == SD_FAULT_AT_BUSY) {
+        if(cls == SD_STRESS_BUSY) {
+            Fire();
+            s.busy = true;
+        }
+        return s.busy && (SD_TICKS() - s.fired < s.busy_ticks);
+    }
+    if((at == SD_FAULT_AT_CMD) && (cls == SD_STRESS_CMD_CRC)) {
+        Fire();
+        return sta | SDIO_FLAG_CCRCFAIL;
+    }
+    if((at == SD_FAULT_AT_CMD) && (cls == SD_STRESS_CMD_TIMEOUT)) {
+        Fire();
+        return sta | SDIO_FLAG_CTIMEOUT;
+    }
+    if(at != SD_FAULT_AT_DATA)
+        return (sta);
+    if(cls == SD_STRESS_DATA_CRC) {
+        Fire();
+        return sta | SDIO_FLAG_DCRCFAIL;
+    }
+    if(cls == SD_STRESS_DATA_TIMEOUT) {
+        Fire();
+        return sta | SDIO_FLAG_DTIMEOUT;
+    }
+    if(cls == SD_STRESS_FIFO) {
+        Fire();
+        return sta | (s.write ? SDIO_FLAG_TXUNDERR : SDIO_FLAG_RXOVERR);
+    }
+    return (sta);
+}
+
+static SD_Error Issue(bool write, u32_t lba, u32_t n)
+{
+    SD_Error ret = SD_ERROR;
+    for(int i = 0; (i < SD_STRESS_TRIES) && (ret != SD_OK); i++) {
+        if(write)
+            ret = SD_WriteSectors(lba, s.buf, n);
+        else
+            ret = SD_ReadSectors(lba, s.buf, n);
+    }
+    return (ret);
+}
+
+SD_Error SD_StressRun(const SD_StressCfg* cfg, SD_StressReport* rep)
+{
+    SD_Error ret = SD_OK;
+    SD_StressClass* c;
+    u32_t i, r, n, lba, cls, t, clean;
+    bool write;
+    if(!cfg->seed || (cfg->nsectors < SD_STRESS_MAX))
+        return SD_INVALID_PARAMETER;
+    *rep = (SD_StressReport){0};
+    s.rand = s.salt = cfg->seed;
+    s.busy_ticks = cfg->busy_ms * SD_TICKS_PER_MS;
+    s.armed = SD_STRESS_CLASSES;
+    s.busy = false;
+    SD_SetFaultHook(NULL);
+    for(i = 0; i < cfg->nsectors; i += n) {     // known contents
+        n = cfg->nsectors - i;
+        if(n > SD_STRESS_MAX)
+            n = SD_STRESS_MAX;
+        Fill(cfg->lba + i, n);
+        ret = SD_WriteSectors(cfg->lba + i, s.buf, n);
+        if(ret != SD_OK)
+            return (ret);
+    }
+    SD_SetFaultHook(Hook);
+    for(i = 0; i < cfg->requests; i++) {
+        r = Rand();
+        write = r & 1;
+        n = 1 + (r >> 1) % SD_STRESS_MAX;
+        lba = cfg->lba + (r >> 8) % (cfg->nsectors - n + 1);
+        r = Rand() % 1000;
+        for(cls = 0; (cls < SD_STRESS_CLASSES) && (r >= cfg->rate[cls]); cls++)
+            r -= cfg->rate[cls];
+        if((cls == SD_STRESS_BUSY) && !write)
+            cls = SD_STRESS_CLASSES;
+        rep->requests++;
+        rep->sectors += n;
+        if(write)
+            Fill(lba, n);
+        t = SD_TICKS();
+        ret = Issue(write, lba, n);
+        clean = SD_TICKS() - t;
+        rep->clean_ticks += clean;
+        if(ret != SD_OK)
+            rep->errors++;
+        else if(!write)
+            rep->corrupt += Check(lba, n);
+        if(cls == SD_STRESS_CLASSES) {
+            rep->fault_ticks += clean;
+            continue;
+        }
+        /* the same request again, with the fault */
+        if(write)
+            Fill(lba, n);
+        s.write = write;
+        s.hit = false;
+        s.armed = cls;
+        t = SD_TICKS();
+        ret = Issue(write, lba, n);
+        r = SD_TICKS();
+        s.armed = SD_STRESS_CLASSES;
+        s.busy = false;
+        rep->fault_ticks += r - t;
+        if(!s.hit)      // the request never got to the check
+            continue;
+        c = &rep->cls[cls];
+        c->injected++;
+        if(r - t > clean)
+            c->lost += r - t - clean;
+        if(ret != SD_OK) {
+            c->failed++;
+            if(write && (Issue(true, lba, n) != SD_OK))    // known contents
+                rep->errors++;
+            continue;
+        }
+        if(!write)
+            rep->corrupt += Check(lba, n);
+        c->recover_sum += r - s.fired;
+        if(r - s.fired > c->recover_max)
+            c->recover_max = r - s.fired;
+    }
+    SD_SetFaultHook(NULL);
+    return (rep->errors || rep->corrupt) ? SD_ERROR : SD_OK;
+}
+
+#endif
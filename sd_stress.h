@@ -0,0 +1,62 @@
+#ifndef _SD_STRESS_H
+#define _SD_STRESS_H
+
+#include "sdio.h"
+
+/* Fault injection stress run, for a driver built with SD_FAULT_INJECT.
+ * A random mix of reads and writes of 1 to SD_STRESS_MAX sectors goes to
+ * a scratch area. Every request runs clean first; when a fault is drawn
+ * for it, it runs again right away with that fault injected, so the
+ * difference of the two is the time the fault cost. A failed request is
+ * issued again, as a file system would, up to SD_STRESS_TRIES times.
+ * Each sector holds a pattern of its own lba that is checked on every
+ * read, so a recovery that loses or misplaces data shows up as
+ * corruption and not only as an error code.
+ * Takes over the fault hook and overwrites the whole scratch area.
+ * Times are in SD_TICKS(). tools/sd_sim.c runs it on a host, against a
+ * model of the controller and the card. */
+#ifndef SD_STRESS_MAX
+#define SD_STRESS_MAX       8   // sectors per request, 4 KiB of RAM
+#endif
+#ifndef SD_STRESS_TRIES
+#define SD_STRESS_TRIES     4   // issues of a request before giving up
+#endif
+
+enum {
+    SD_STRESS_CMD_CRC,      // command response CRC failed
+    SD_STRESS_CMD_TIMEOUT,  // no command response
+    SD_STRESS_DATA_CRC,
+    SD_STRESS_DATA_TIMEOUT,
+    SD_STRESS_FIFO,         // RX overrun on reads, TX underrun on writes
+    SD_STRESS_BUSY,         // card programming for busy_ms, writes only
+    SD_STRESS_CLASSES
+};
+
+typedef struct {
+    unsigned long lba, nsectors;    // scratch area, >= SD_STRESS_MAX
+    unsigned long requests;
+    unsigned short rate[SD_STRESS_CLASSES]; // faults per 1000 requests
+    unsigned long busy_ms;
+    unsigned long seed;             // non zero, same seed same run
+} SD_StressCfg;
+
+typedef struct {
+    unsigned long injected;         // faults that hit a request
+    unsigned long failed;           // of those, requests given up on
+    unsigned long recover_sum, recover_max; // from the fault to success
+    unsigned long lost;             // time over the clean runs
+} SD_StressClass;
+
+typedef struct {
+    unsigned long requests, sectors;
+    unsigned long clean_ticks;      // all requests without faults
+    unsigned long fault_ticks;      // with faults where drawn
+    unsigned long errors;           // clean requests that failed
+    unsigned long corrupt;          // sectors read back wrong
+    SD_StressClass cls[SD_STRESS_CLASSES];
+} SD_StressReport;
+
+/* SD_ERROR when a clean request failed or data was corrupted */
+SD_Error SD_StressRun(const SD_StressCfg* cfg, SD_StressReport* rep);
+
+#endif
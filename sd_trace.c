@@ -0,0 +1,43 @@
+#include "misc.h"
+#include "sdio.h"
+#include "sd_trace.h"
+
+typedef unsigned long u32_t;
+
+static struct {
+    SD_TraceRec rec[SD_TRACE_RECORDS];
+    u32_t head;     // records ever added
+} t;
+
+void SD_TraceAdd(unsigned char op, u32_t lba, u32_t count, u32_t start,
+        unsigned char result, unsigned short card)
+{
+    u32_t now = SD_TICKS(), primask = __get_PRIMASK();
+    SD_TraceRec* r;
+    __disable_irq();
+    r = &t.rec[t.head++ & (SD_TRACE_RECORDS - 1)];
+    r->time = start;
+    r->lba = lba;
+    r->count = count;
+    r->latency = now - start;
+    r->op = op;
+    r->result = (result == SD_OK) ? 0 : result;
+    r->card = card;
+    __set_PRIMASK(primask);
+}
+
+void SD_TraceDump(void (*out)(const void* data, u32_t len))
+{
+    u32_t head = t.head, i;
+    SD_TraceHdr h = {SD_TRACE_MAGIC, SD_TICKS_PER_MS, 0, 0};
+    h.count = (head < SD_TRACE_RECORDS) ? head : SD_TRACE_RECORDS;
+    h.lost = head - h.count;
+    out(&h, sizeof(h));
+    for(i = head - h.count; i != head; i++)
+        out(&t.rec[i & (SD_TRACE_RECORDS - 1)], sizeof(SD_TraceRec));
+}
+
+void SD_TraceReset(void)
+{
+    t.head = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _SD_TRACE_H
+#define _SD_TRACE_H
+
+#include <stdint.h>
+
+/* I/O trace: with SD_TRACE defined the driver adds one record per block
+ * read, write or erase request, command queue task and SDIO CMD53
+ * transfer to a RAM ring of SD_TRACE_RECORDS, the oldest overwritten.
+ * SD_TraceDump() hands out a header and then the records, oldest first;
+ * tools/sd_replay.c reads that. The records are fixed width little
+ * endian, the same on the target and the host. Times are SD_TICKS(),
+ * which wrap: gaps over 2^32 ticks are lost. */
+#define SD_TRACE_MAGIC      0x52544453UL    // "SDTR"
+#ifndef SD_TRACE_RECORDS
+#define SD_TRACE_RECORDS    256     // power of two
+#endif
+#if (SD_TRACE_RECORDS < 1) || (SD_TRACE_RECORDS & (SD_TRACE_RECORDS - 1))
+#error "SD_TRACE_RECORDS must be a power of two"
+#endif
+
+enum {
+    SD_TRACE_READ = 1,
+    SD_TRACE_WRITE = 2,
+    SD_TRACE_ERASE = 3,
+    SD_TRACE_IO_READ = 4,   // lba: function << 17 | address, count: bytes
+    SD_TRACE_IO_WRITE = 5,
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t ticks_per_ms;
+    uint32_t count;         // records that follow
+    uint32_t lost;          // older ones overwritten
+} SD_TraceHdr;
+
+typedef struct {
+    uint32_t time;          // at the call, queue tasks at the submit
+    uint32_t lba, count;    // 512 byte sectors
+    uint32_t latency;       // call to return
+    uint8_t op, result;     // SD_TRACE_*, 0 or the SD_Error
+    uint16_t card;          // in SD_CardAttach() order
+} SD_TraceRec;
+
+void SD_TraceAdd(unsigned char op, unsigned long lba, unsigned long count,
+        unsigned long start, unsigned char result, unsigned short card);
+/* out() gets the header, then each record; call while the driver is idle */
+void SD_TraceDump(void (*out)(const void* data, unsigned long len));
+void SD_TraceReset(void);
+
+#endif
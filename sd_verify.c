@@ -0,0 +1,103 @@
+#include "misc.h"
+#include "sd_verify.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef unsigned long u32_t;
+
+static struct {
+    const u32_t* src;   // data being CRCed
+    u32_t nbytes, fed;  // fed: bytes given to the CRC unit
+    bool ahead;         // source complete, do not wait for the DMA
+    bool check;         // compare with crc[] instead of storing
+    u32_t lba, bad;     // first block of the chunk, mismatching blocks
+    SD_VerifyStats st;
+    u32_t crc[SD_VERIFY_CHUNK];
+    u32_t buf[SD_VERIFY_CHUNK][128];
+} v;
+
+SD_Error SD_VerifyInit(void)
+{
+    SD_CRC_CLOCK_ON();
+    memset(&v.st, 0, sizeof(v.st));
+    return SD_OK;
+}
+
+/* DMA progress hook: run the CRC unit over what the DMA has covered */
+static void feed(u32_t done)
+{
+    u32_t end = v.ahead ? v.nbytes : (done & ~3UL), i;
+    while(v.fed < end) {
+        CRC->DR = v.src[v.fed / 4];
+        v.fed += 4;
+        if(v.fed % 512)
+            continue;
+        i = v.fed / 512 - 1;
+        if(!v.check)
+            v.crc[i] = CRC->DR;
+        else if(v.crc[i] != CRC->DR) {
+            if(!v.bad++ && !v.st.mismatches)
+                v.st.bad_lba = v.lba + i;
+        }
+        CRC->CR = CRC_CR_RESET;
+    }
+}
+
+static SD_Error transfer(bool check, u32_t lba, const void* buff, u32_t n)
+{
+    SD_Error ret;
+    u32_t t0 = SD_TICKS();
+    v.src = buff;
+    v.nbytes = n * 512;
+    v.fed = 0;
+    v.ahead = !check;
+    v.check = check;
+    CRC->CR = CRC_CR_RESET;
+    SD_SetDmaProgress(feed);
+    if(check)
+        ret = SD_ReadSectors(lba, (void*)buff, n);
+    else
+        ret = SD_WriteSectors(lba, buff, n);
+    SD_SetDmaProgress(NULL);
+    if(ret == SD_OK)
+        feed(v.nbytes);     // paths without DMA progress, e.g. command queue
+    if(check)
+        v.st.read_ticks += SD_TICKS() - t0;
+    else
+        v.st.write_ticks += SD_TICKS() - t0;
+    return (ret);
+}
+
+SD_Error SD_VerifyWrite(u32_t lba, const void* buff, u32_t nblocks)
+{
+    SD_Error ret = SD_OK;
+    const char* p = buff;
+    u32_t n;
+    if((buff == NULL) || ((u32_t)buff & 3) || (nblocks == 0))
+        return SD_INVALID_PARAMETER;
+    while(nblocks) {
+        n = (nblocks > SD_VERIFY_CHUNK) ? SD_VERIFY_CHUNK : nblocks;
+        v.lba = lba;
+        v.bad = 0;
+        ret = transfer(false, lba, p, n);
+        if(ret == SD_OK)
+            ret = transfer(true, lba, v.buf, n);
+        if(ret != SD_OK)
+            return (ret);
+        v.st.blocks += n;
+        v.st.mismatches += v.bad;
+        if(v.bad)
+            return SD_ERROR;
+        lba += n;
+        p += n * 512;
+        nblocks -= n;
+    }
+    return (ret);
+}
+
+void SD_VerifyGetStats(SD_VerifyStats* st, bool reset)
+{
+    *st = v.st;
+    if(reset)
+        memset(&v.st, 0, sizeof(v.st));
+}
@@ -0,0 +1,27 @@
+#ifndef _SD_VERIFY_H
+#define _SD_VERIFY_H
+
+#include "sdio.h"
+
+/* Verified writes. Every block gets a CRC from the CRC unit while its write
+ * DMA runs, the chunk is read back into a scratch buffer and its CRCs are
+ * computed while the read DMA runs, so only CRCs are compared and the CPU
+ * work hides behind the bus transfers.
+ * All addresses are in 512 byte sectors. */
+#ifndef SD_VERIFY_CHUNK
+#define SD_VERIFY_CHUNK     16  /* sectors read back at once, 8 KiB of RAM */
+#endif
+
+typedef struct {
+    unsigned long blocks, mismatches;
+    unsigned long bad_lba;      // first block that did not match
+    unsigned long write_ticks, read_ticks;  // time in writes, in read-back
+} SD_VerifyStats;
+
+SD_Error SD_VerifyInit(void);
+/* SD_ERROR when a block read back differs, see SD_VerifyStats.bad_lba */
+SD_Error SD_VerifyWrite(unsigned long lba, const void* buff,
+        unsigned long nblocks);
+void SD_VerifyGetStats(SD_VerifyStats* st, bool reset);
+
+#endif
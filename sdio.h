@@ -0,0 +1,27 @@
+#ifndef _SDIO_H
+#define _SDIO_H
+
+/* chip independent entry point for the layers built on top of the driver */
+#if defined(STM32F10X_HD) || defined(STM32F10X_XL) || defined(STM32F10X_HD_VL)
+#include "sdio_f1.h"
+#define SD_CRC_CLOCK_ON()   RCC_AHBPeriphClockCmd(RCC_AHBPeriph_CRC, ENABLE)
+#else
+#include "sdio_f4.h"
+#define SD_CRC_CLOCK_ON()   RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_CRC, ENABLE)
+#endif
+
+/* free running cycle counter for timing and statistics, started by SD_Init */
+#define SD_TICKS()          (DWT->CYCCNT)
+#define SD_TICKS_PER_MS     (SystemCoreClock / 1000)
+
+/* CRC unit over nwords words, the clock must be on (SD_CRC_CLOCK_ON) */
+static inline unsigned long SD_CRC32(const void* buff, unsigned long nwords)
+{
+    const unsigned long* p = buff;
+    CRC->CR = CRC_CR_RESET;
+    while(nwords--)
+        CRC->DR = *p++;
+    return CRC->DR;
+}
+
+#endif
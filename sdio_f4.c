@@ -1,14 +1,117 @@
 #include "misc.h"
 #include "sdio_f4.h"
 #include <stdbool.h>
+#ifdef SD_TRACE
+#include "sd_trace.h"
+#endif
 
 typedef unsigned long u32_t;
 typedef unsigned short u16_t;
 typedef unsigned char u8_t;
 
+#ifndef SD_WRITE_SLICE
+#define SD_WRITE_SLICE  256 // blocks per CMD25 while a write yield hook is set
+#endif
+#ifndef SD_CQ_DEPTH
+#define SD_CQ_DEPTH     8   // task slots, the card may allow up to 32
+#endif
+
+#ifndef SD_FIFO_RETRIES
+#define SD_FIFO_RETRIES 3   // runs at a lower clock after a FIFO error
+#endif
+
+#ifndef SD_PIO_MAX
+#define SD_PIO_MAX      64  // bytes, shorter transfers poll the FIFO
+#endif
+
+#ifndef SD_CMD_TIMEOUT_MS
+#define SD_CMD_TIMEOUT_MS   10  // response, CTIMEOUT comes after 64 clocks
+#endif
+#ifndef SD_DATA_TIMEOUT_MS
+#define SD_DATA_TIMEOUT_MS  1000    // data phase not moving, backs up DTIMER
+#endif
+#ifndef SD_BUSY_TIMEOUT_MS
+#define SD_BUSY_TIMEOUT_MS  1000    // card programming after a write
+#endif
+
+#ifndef SD_MAX_CARDS
+#define SD_MAX_CARDS    2
+#endif
+
+/* one card: controller and DMA binding, bus setup and card state */
+struct SD_Card {
+    SDIO_TypeDef* sdio;     // controller
+    DMA_Stream_TypeDef* dma;    // its DMA stream, channel 4
+    u32_t dma_tc;           // transfer complete flag of the stream
+    void (*select)(void);   // board bus switch, NULL if none
+    u32_t clkcr;            // bus width and clock while not selected
+    u32_t dma_cr;           // DMA control image, no direction, not enabled
+    u32_t blklen;           // CMD16 length the card has, 0: unknown
+    u32_t type, rca, size, au, cid[4], csd[4], scr[2];    // size, au in kbytes
+    void (*yield)(void);    // runs between slices of long writes
+    bool posted, busy;      // posted writes, one still programming
+    void (*progress)(u32_t nbytes); // block transfer DMA progress
+    SD_FifoStats fifo;      // data path errors and their recovery
+    u32_t t0;               // request entry, for the setup time
+    SD_SetupStats setup;
+    u32_t data_end, data_left;  // data phase deadline, DCOUNT when set
+    u32_t busy_ms;          // bound of the pending busy, 0: SD_BUSY_TIMEOUT_MS
+    u32_t erase_unit, erase_ms, erase_off;  // sectors, ms per unit, + ms
+    bool mmc_erased_ff;     // EXT_CSD ERASED_MEM_CONT, SD has it in the SCR
+    bool mmc_trim;          // EXT_CSD SEC_GB_CL_EN, else plain erase
+    SD_TimeoutStats tmo;    // bounded waits that ran out
+    struct {
+        u32_t* buf;         // polled transfer pending, NULL: DMA
+        u32_t nwords;
+        bool write;
+    } pio;
+    u32_t perf, perf_off, perf_caps, cache;    // SD 6.0 performance enhancement
+    struct {
+        u32_t nfunc, manf, card;    // I/O functions, CISTPL_MANFID
+        u16_t blksz[8];
+        void (*irq)(void);
+    } io;
+    struct {
+        u32_t max, depth, busy, queued;    // slot bitmaps
+        struct {
+            void* buf;
+            u32_t lba, nblocks, write;
+            u32_t start;    // submitted, for the trace
+            SD_Error ret;
+        } task[SD_CQ_DEPTH];
+    } cq;
+};
+
+/* the driver works on the selected card, card 0 unless SD_Select() */
+static SD_Card cards[SD_MAX_CARDS] = {{SDIO, DMA2_Stream3, DMA_FLAG_TCIF3}};
+static SD_Card* g = cards;
+static u32_t ncards;
+static u32_t pio_max = SD_PIO_MAX;
+
+/* idle power policy, for the controller of whichever card is selected */
 static struct {
-    u32_t type, rca, size, cid[4], csd[4];    // size in kbytes
-} g;
+    u32_t policy, idle;     // SD_IDLE_* bits, gate after idle ticks
+    bool gated;             // SDIO_CK and the peripheral clock off
+    u32_t last, since;      // last bus use, last change of state
+    SD_IdleStats st;
+} pm;
+
+/* DMA2 has no path to the core coupled memory */
+#define DMA_UNREACHABLE(p)  (((u32_t)(p) >> 16) == 0x1000)
+
+#define IS_MMC              (g->type == SDTYPE_MMC || g->type == SDTYPE_HCMMC)
+#define BLOCK_ADDRESSED     (g->type == SDTYPE_SDHC || g->type == SDTYPE_HCMMC)
+/* data command argument for a byte address, and for a 512 byte sector;
+ * block addressed cards never see a byte address, which wraps at 4 GiB */
+#define CARD_ADDR(addr)     (BLOCK_ADDRESSED ? (addr) / 512 : (addr))
+#define SECTOR_ADDR(lba)    (BLOCK_ADDRESSED ? (lba) : (lba) * 512)
+/* SCR CMD_SUPPORT, bits 35:32 of the big endian register; always on eMMC */
+#define CMD23_SUPPORT       ((((u8_t*)g->scr)[3] & 0x2) || IS_MMC)
+#define CMD48_SUPPORT       (((u8_t*)g->scr)[3] & 0x4)
+/* performance enhancement register bytes */
+#define PERF_CACHE_EN       260
+#define PERF_FLUSH          261
+#define PERF_CQ_EN          262
 
 enum {
     SD_R6_GENERAL_UNKNOWN_ERROR = 0x2000,
@@ -25,6 +128,7 @@ enum {
     SD_CARD_LOCKED = 0x2000000,
     SD_CARD_PROGRAMMING = 0x7,
     SD_CARD_RECEIVING = 0x6,
+    SD_CARD_SENDING = 0x5,
     SD_DATATIMEOUT = 0xfffff,
     SD_0TO7BITS = 0xff,
     SD_8TO15BITS = 0xff00,
@@ -73,6 +177,7 @@ enum {
     CMD18 = 18,
     CMD19 = 19,
     CMD20 = 20,
+    CMD23 = 23,
     CMD24 = 24,
     CMD25 = 25,
     CMD26 = 26,
@@ -88,6 +193,15 @@ enum {
     CMD39 = 39,
     CMD40 = 40,
     CMD42 = 42,
+    CMD43 = 43,
+    CMD44 = 44,
+    CMD45 = 45,
+    CMD46 = 46,
+    CMD47 = 47,
+    CMD48 = 48,
+    CMD49 = 49,
+    CMD52 = 52,
+    CMD53 = 53,
     CMD55 = 55,
     CMD56 = 56,
     CMD64 = 64,
@@ -123,6 +237,38 @@ enum {
     SDTYPE_HCMMC = 0x7
 };
 
+enum {
+    MMC_VOLTAGE_WINDOW = 0x00ff8000,
+    MMC_SWITCH_ERROR = 0x80,
+    /* EXT_CSD byte offsets */
+    EXT_CSD_ERASE_GROUP_DEF = 175, EXT_CSD_ERASED_MEM_CONT = 181,
+    EXT_CSD_BUS_WIDTH = 183,
+    EXT_CSD_HS_TIMING = 185,
+    EXT_CSD_CARD_TYPE = 196,
+    EXT_CSD_SEC_COUNT = 212,
+    EXT_CSD_ERASE_TIMEOUT_MULT = 223, EXT_CSD_HC_ERASE_GRP_SIZE = 224,
+    EXT_CSD_SEC_FEATURE_SUPPORT = 231, EXT_CSD_TRIM_MULT = 232,
+};
+
+enum {
+    SDIO_OCR_MEM_PRESENT = 0x08000000,
+    SD_R5_OUT_OF_RANGE = 0x100,
+    SD_R5_FUNCTION_NUMBER = 0x200,
+    SD_R5_ERROR = 0x800,
+    /* CCCR / FBR registers, function 0 address space */
+    CCCR_IO_ENABLE = 0x02,
+    CCCR_IO_READY = 0x03,
+    CCCR_INT_ENABLE = 0x04,
+    CCCR_IO_ABORT = 0x06,
+    CCCR_BUS_IF = 0x07,
+    CCCR_CAPS = 0x08,
+    CCCR_CIS_PTR = 0x09,
+    FBR_BLKSIZE = 0x10,
+    CISTPL_MANFID = 0x20,
+    CISTPL_FUNCE = 0x22,
+    CISTPL_END = 0xff,
+};
+
 enum {
     SD_OCR_ADDR_OUT_OF_RANGE = 0x80000000,
     SD_OCR_ADDR_MISALIGNED = 0x40000000,
@@ -173,38 +319,138 @@ const struct {
 #define CMD_CLEAR_MASK              (0xfffff800UL)
 #define DCTRL_CLEAR_MASK            ((u32_t)0xffffff08)
 
+/* Undo SD_IdlePoll() gating before the controller is touched; a few
+ * register writes, the card kept its state */
+static void SDWake(void)
+{
+    u32_t now = DWT->CYCCNT;
+    pm.last = now;
+    if(!pm.gated)
+        return;
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_SDIO, ENABLE);
+    g->sdio->CLKCR |= _BV(8);    // SDIO_CK on
+    pm.st.idle += now - pm.since;
+    pm.since = now;
+    pm.gated = false;
+}
+
+/* PWRSAV per the policy, but not while an SDIO card may signal an
+ * interrupt on DAT1, which it can only do with SDIO_CK running */
+static void SDPwrSav(void)
+{
+    if((pm.policy & SD_IDLE_PWRSAV) && !g->io.irq)
+        g->sdio->CLKCR |= _BV(9);    // SDIO_CK only while the bus is busy
+    else
+        g->sdio->CLKCR &= ~_BV(9);
+}
+
+/* SPL calls on the selected card's controller */
+static void SDIO_ClearFlagEx(u32_t flag)
+{
+    g->sdio->ICR = flag;
+}
+
+static u32_t SDIO_GetResponseEx(u32_t resp)
+{
+    return (&g->sdio->RESP1)[resp / 4];   // RESPx are 32 bit, unlike u32_t on a host
+}
+
+static u8_t SDIO_GetCommandResponseEx(void)
+{
+    return (u8_t)g->sdio->RESPCMD;
+}
+
+static void SDIO_DMACmdEx(FunctionalState state)
+{
+    SDWake();
+    if(state != DISABLE)
+        g->sdio->DCTRL |= _BV(3);
+    else
+        g->sdio->DCTRL &= ~_BV(3);
+}
+
+/* DWT tick deadline ms from now, for the bounded waits */
+static u32_t SDDeadline(u32_t ms)
+{
+    return DWT->CYCCNT + ms * (SystemCoreClock / 1000);
+}
+static bool SDExpired(u32_t deadline)
+{
+    return (long)(DWT->CYCCNT - deadline) > 0;
+}
+
 static void SDIO_SendCmdEx(u8_t cmd, u32_t arg, u32_t options)
 {
     u32_t tmp;
-    SDIO->ARG = arg;
-    tmp = (SDIO->CMD & CMD_CLEAR_MASK) | cmd | options;
-    SDIO->CMD = tmp;
-    ( {  while (SDIO->STA & SDIO_FLAG_CMDACT);});
+    SDWake();
+    g->sdio->ARG = arg;
+    tmp = (g->sdio->CMD & CMD_CLEAR_MASK) | cmd | options;
+    g->sdio->CMD = tmp;
+    if(g->t0 && ((cmd == CMD17) || (cmd == CMD18) || (cmd == CMD24)
+            || (cmd == CMD25))) {
+        tmp = DWT->CYCCNT - g->t0;
+        g->t0 = 0;
+        g->setup.count++;
+        g->setup.sum += tmp;
+        if(tmp > g->setup.max)
+            g->setup.max = tmp;
+    }
+    tmp = SDDeadline(SD_CMD_TIMEOUT_MS);
+    while((g->sdio->STA & SDIO_FLAG_CMDACT) && !SDExpired(tmp))
+        ;
+}
+
+#ifdef SD_FAULT_INJECT
+static u32_t (*fault)(u8_t at, u32_t sta);
+#endif
+
+/* response flags of the last command, CTIMEOUT if none came in time */
+static u32_t SDWaitResp(void)
+{
+    u32_t status, deadline = SDDeadline(SD_CMD_TIMEOUT_MS);
+    while(!((status = g->sdio->STA)
+            & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT))) {
+        if(SDExpired(deadline)) {
+            g->tmo.cmd++;
+            return SDIO_FLAG_CTIMEOUT;
+        }
+    }
+#ifdef SD_FAULT_INJECT
+    if(fault) {
+        u32_t sta = fault(SD_FAULT_AT_CMD, status);
+        if(sta != status) {     // injected, the response is dropped
+            SDIO_ClearFlagEx(SDIO_FLAG_CMDREND);
+            status = sta & ~SDIO_FLAG_CMDREND;
+        }
+    }
+#endif
+    return (status);
 }
 
 static SD_Error IsCardProgramming(u8_t* pstatus)
 {
     SD_Error ret = SD_OK;
     u32_t respR1 = 0, status = 0;
-    SDIO_SendCmdEx(CMD13, g.rca << 16, CMD_EX_DEFAULT);
-    do {
-        status = SDIO->STA;
-    } while(!(status
-            & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT)));
+    SDIO_SendCmdEx(CMD13, g->rca << 16, CMD_EX_DEFAULT);
+    status = SDWaitResp();
     if(status & SDIO_FLAG_CTIMEOUT) {
-        SDIO_ClearFlag(SDIO_FLAG_CTIMEOUT);
+        SDIO_ClearFlagEx(SDIO_FLAG_CTIMEOUT);
         return SD_CMD_RSP_TIMEOUT;
     }
     else if(status & SDIO_FLAG_CCRCFAIL) {
-        SDIO_ClearFlag(SDIO_FLAG_CCRCFAIL);
+        SDIO_ClearFlagEx(SDIO_FLAG_CCRCFAIL);
         return SD_CMD_CRC_FAIL;
     }
-    status = (u32_t)SDIO_GetCommandResponse();
+    status = (u32_t)SDIO_GetCommandResponseEx();
     if(status != CMD13)
         return SD_ILLEGAL_CMD;
-    SDIO_ClearFlag(SDIO_STATIC_FLAGS);
-    respR1 = SDIO_GetResponse(SDIO_RESP1);
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
+    respR1 = SDIO_GetResponseEx(SDIO_RESP1);
     *pstatus = (u8_t)((respR1 >> 9) & 0x0000000F);
+#ifdef SD_FAULT_INJECT
+    if(fault && fault(SD_FAULT_AT_BUSY, 0))
+        *pstatus = SD_CARD_PROGRAMMING;
+#endif
     if((respR1 & SD_OCR_ERRORBITS) == SD_ALLZERO) {
         return (ret);
     }
@@ -215,37 +461,75 @@ static SD_Error IsCardProgramming(u8_t* pstatus)
     return (ret);
 }
 
+/* wait while the card programs, SD_DATA_TIMEOUT after ms; long erases
+ * are waited for in slices of a second, the tick counter wraps in 25 s */
+static SD_Error SDBusyWait(u32_t ms)
+{
+    SD_Error ret = SD_OK;
+    u8_t state = 0;
+    u32_t slice = (ms > 1000) ? 1000 : ms, deadline = SDDeadline(slice);
+    for(;;) {
+        ret = IsCardProgramming(&state);
+        if((ret != SD_OK)
+                || ((state != SD_CARD_PROGRAMMING) && (state != SD_CARD_RECEIVING)))
+            return (ret);
+        if(!SDExpired(deadline))
+            continue;
+        ms -= slice;
+        if(ms == 0) {
+            g->tmo.busy++;
+            return SD_DATA_TIMEOUT;
+        }
+        slice = (ms > 1000) ? 1000 : ms;
+        deadline = SDDeadline(slice);
+    }
+}
+
+/* wait for the card to finish programming a posted write */
+static SD_Error SDWaitProgrammed(void)
+{
+    SD_Error ret = SD_OK;
+    if(!g->busy)
+        return SD_OK;
+    ret = SDBusyWait(g->busy_ms ? g->busy_ms : SD_BUSY_TIMEOUT_MS);
+    g->busy = (ret == SD_DATA_TIMEOUT); // still programming, wait next time
+    if(!g->busy)
+        g->busy_ms = 0;
+    return (ret);
+}
+
 void SDIO_DataCfgEx(u32_t datalength, u32_t blocksize, u32_t dir, u32_t dpsm)
 {
-    SDIO->DTIMER = SD_DATATIMEOUT;
-    SDIO->DLEN = datalength;
-    SDIO->DCTRL = (SDIO->DCTRL & DCTRL_CLEAR_MASK)
+    SDWake();
+    g->sdio->DTIMER = SD_DATATIMEOUT;
+    g->sdio->DLEN = datalength;
+    g->sdio->DCTRL = (g->sdio->DCTRL & DCTRL_CLEAR_MASK)
             | (blocksize | dir | SDIO_TransferMode_Block | dpsm);
 }
 
 static void SDIO_SetClockDiv(u32_t clkdiv)
 {
     clkdiv &= 0xff;
-    SDIO->CLKCR = (SDIO->CLKCR & 0xffffff00) | clkdiv;
+    g->sdio->CLKCR = (g->sdio->CLKCR & 0xffffff00) | clkdiv;
 }
 static void SDIO_SetBusWidth(u32_t buswidth)
 {
     buswidth &= (_BV(12) | _BV(11));
-    SDIO->CLKCR = (SDIO->CLKCR & ~(_BV(12) | _BV(11))) | buswidth;
+    g->sdio->CLKCR = (g->sdio->CLKCR & ~(_BV(12) | _BV(11))) | buswidth;
 }
 static SD_Error CmdError(void)
 {
     SD_Error ret = SD_OK;
     u32_t timeout;
     timeout = SDIO_CMD0TIMEOUT; /* 10000 */
-    while((timeout > 0) && (SDIO_GetFlagStatus(SDIO_FLAG_CMDSENT) == RESET))
+    while((timeout > 0) && ((g->sdio->STA & SDIO_FLAG_CMDSENT) == 0))
         timeout--;
     if(timeout == 0) {
         ret = SD_CMD_RSP_TIMEOUT;
         return (ret);
     }
     /* Clear all the static flags */
-    SDIO_ClearFlag(SDIO_STATIC_FLAGS);
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
     return (ret);
 }
 static SD_Error CmdResp7Error(void)
@@ -253,51 +537,56 @@ static SD_Error CmdResp7Error(void)
     SD_Error ret = SD_OK;
     u32_t status;
     u32_t timeout = SDIO_CMD0TIMEOUT;
-    status = SDIO->STA;
+    status = g->sdio->STA;
     while(!(status
             & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT))
             && (timeout > 0)) {
         timeout--;
-        status = SDIO->STA;
+        status = g->sdio->STA;
     }
     if((timeout == 0) || (status & SDIO_FLAG_CTIMEOUT)) {
         /* Card is not V2.0 complient or card does not support the set voltage range */
         ret = SD_CMD_RSP_TIMEOUT;
-        SDIO_ClearFlag(SDIO_FLAG_CTIMEOUT);
+        SDIO_ClearFlagEx(SDIO_FLAG_CTIMEOUT);
         return (ret);
     }
     if(status & SDIO_FLAG_CMDREND) {
         /* Card is SD V2.0 compliant */
         ret = SD_OK;
-        SDIO_ClearFlag(SDIO_FLAG_CMDREND);
+        SDIO_ClearFlagEx(SDIO_FLAG_CMDREND);
         return (ret);
     }
     return (ret);
 }
-static SD_Error CmdResp1Error(u8_t cmd)
+/* R1 format checks only, for a response argument that is not a card
+ * status (the QSR of CMD13 with SQS) */
+static SD_Error CmdResp1Frame(u8_t cmd)
 {
-    SD_Error ret = SD_OK;
     u32_t status;
-    u32_t response_r1;
-    status = SDIO->STA;
-    while(!(status
-            & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT))) {
-        status = SDIO->STA;
-    }
+    status = SDWaitResp();
     if(status & SDIO_FLAG_CTIMEOUT) {
-        SDIO_ClearFlag(SDIO_FLAG_CTIMEOUT);
+        SDIO_ClearFlagEx(SDIO_FLAG_CTIMEOUT);
         return SD_CMD_RSP_TIMEOUT;
     }
     else if(status & SDIO_FLAG_CCRCFAIL) {
-        SDIO_ClearFlag(SDIO_FLAG_CCRCFAIL);
+        SDIO_ClearFlagEx(SDIO_FLAG_CCRCFAIL);
         return SD_CMD_CRC_FAIL;
     }
     /* Check response received is of desired command */
-    if(SDIO_GetCommandResponse() != cmd)
+    if(SDIO_GetCommandResponseEx() != cmd)
         return SD_ILLEGAL_CMD;
-    SDIO_ClearFlag(SDIO_STATIC_FLAGS); /* Clear all the static flags */
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS); /* Clear all the static flags */
+    return SD_OK;
+}
+
+static SD_Error CmdResp1Error(u8_t cmd)
+{
+    SD_Error ret = CmdResp1Frame(cmd);
+    u32_t response_r1;
+    if(ret != SD_OK)
+        return (ret);
     /* We have received response, retrieve it for analysis  */
-    response_r1 = SDIO_GetResponse(SDIO_RESP1);
+    response_r1 = SDIO_GetResponseEx(SDIO_RESP1);
     if((response_r1 & SD_OCR_ERRORBITS) == SD_ALLZERO)
         return (ret);
     for(int i = 0; i < sizeof(err_lut) / sizeof(err_lut[0]); i++) {
@@ -310,17 +599,36 @@ static SD_Error CmdResp3Error(void)
 {
     SD_Error ret = SD_OK;
     u32_t status;
-    status = SDIO->STA;
-    while(!(status
-            & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT))) {
-        status = SDIO->STA;
-    }
+    status = SDWaitResp();
     if(status & SDIO_FLAG_CTIMEOUT) {
-        SDIO_ClearFlag(SDIO_FLAG_CTIMEOUT);
+        SDIO_ClearFlagEx(SDIO_FLAG_CTIMEOUT);
         return SD_CMD_RSP_TIMEOUT;
     }
     /* Clear all the static flags */
-    SDIO_ClearFlag(SDIO_STATIC_FLAGS);
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
+    return (ret);
+}
+
+/* I/O part of an SDIO or combo card, ocr from the CMD5 probe */
+static SD_Error SDIOPowerON(u32_t ocr)
+{
+    SD_Error ret = SD_OK;
+    u32_t count = 0;
+    g->io.nfunc = (ocr >> 28) & 0x7;
+    if(g->io.nfunc == 0)
+        return (ret);
+    do {
+        SDIO_SendCmdEx(CMD5, ocr & MMC_VOLTAGE_WINDOW, CMD_EX_DEFAULT);
+        ret = CmdResp3Error();
+        if(ret != SD_OK)
+            return (ret);
+        ocr = SDIO_GetResponseEx(SDIO_RESP1);
+        count++;
+    } while(((ocr >> 31) == 0) && (count < SD_MAX_VOLT_TRIAL));
+    if(count >= SD_MAX_VOLT_TRIAL)
+        return SD_INVALID_VOLTRANGE;
+    if((ocr & SDIO_OCR_MEM_PRESENT) == 0)
+        g->type = SDTYPE_SDIO;
     return (ret);
 }
 
@@ -332,8 +640,8 @@ SD_Error SD_PowerON(void)
     u32_t SDType = SD_STD_CAPACITY;
     SDIO_DeInit();
     SDIO_SetClockDiv(SDIO_INIT_CLK_DIV);
-    SDIO_SetPowerState(SDIO_PowerState_ON);
-    SDIO_ClockCmd(ENABLE);
+    g->sdio->POWER = SDIO_PowerState_ON;
+    g->sdio->CLKCR |= _BV(8);
     SDIO_SendCmdEx(CMD0, 0x0, SDIO_CPSM_Enable);    // CMD0: GO_IDLE_STATE
     ret = CmdError();
     if(ret != SD_OK)
@@ -341,13 +649,19 @@ SD_Error SD_PowerON(void)
     SDIO_SendCmdEx(CMD8, SD_CHECK_PATTERN, CMD_EX_DEFAULT);    // CMD8: SEND_IF_COND
     ret = CmdResp7Error();
     if(ret == SD_OK) {
-        g.type = SDTYPE_SDSC_V2_0; /* SD Card 2.0 */
+        g->type = SDTYPE_SDSC_V2_0; /* SD Card 2.0 */
         SDType = SD_HIGH_CAPACITY;
     }
     else {
         SDIO_SendCmdEx(CMD55, 0x0, CMD_EX_DEFAULT);
         ret = CmdResp1Error(CMD55);
     }
+    SDIO_SendCmdEx(CMD5, 0x0, CMD_EX_DEFAULT);    // CMD5: IO_SEND_OP_COND
+    if(CmdResp3Error() == SD_OK) {
+        ret = SDIOPowerON(SDIO_GetResponseEx(SDIO_RESP1));
+        if((ret != SD_OK) || (SDTYPE_SDIO == g->type))
+            return (ret);
+    }    // combo cards go on with the memory part
     SDIO_SendCmdEx(CMD55, 0x0, CMD_EX_DEFAULT);
     ret = CmdResp1Error(CMD55);
 // TimeOut:  MMC card; SD_OK: SD card 2.0 (voltage range mismatch) or SD card 1.x
@@ -362,41 +676,57 @@ SD_Error SD_PowerON(void)
             ret = CmdResp3Error();
             if(ret != SD_OK)
                 return (ret);
-            response = SDIO_GetResponse(SDIO_RESP1);
+            response = SDIO_GetResponseEx(SDIO_RESP1);
             validvoltage = (bool)(((response >> 31) == 1) ? 1 : 0);
             count++;
         }
         if(count >= SD_MAX_VOLT_TRIAL)
             return SD_INVALID_VOLTRANGE;
         if(response &= SD_HIGH_CAPACITY)
-            g.type = SDTYPE_SDHC;
-    }    // else MMC Card
+            g->type = SDTYPE_SDHC;
+    }
+    else {    // no answer to CMD55: MMC / eMMC, sector mode if it can
+        do {
+            SDIO_SendCmdEx(CMD1, MMC_VOLTAGE_WINDOW | SD_HIGH_CAPACITY,
+                    CMD_EX_DEFAULT);
+            ret = CmdResp3Error();
+            if(ret != SD_OK)
+                return (ret);
+            response = SDIO_GetResponseEx(SDIO_RESP1);
+            count++;
+        } while(((response >> 31) == 0) && (count < SD_MAX_VOLT_TRIAL));
+        if(count >= SD_MAX_VOLT_TRIAL)
+            return SD_INVALID_VOLTRANGE;
+        g->type = (response & SD_HIGH_CAPACITY) ? SDTYPE_HCMMC : SDTYPE_MMC;
+    }
     return (ret);
 }
 
+/* SD_DATA_TIMEOUT leaves a card that is still programming powered */
 SD_Error SD_PowerOff(void)
 {
-    SDIO_SetPowerState(SDIO_PowerState_OFF);
+    SD_Error ret = SDWaitProgrammed();     // a posted write or erase
+    if(ret != SD_OK)
+        return (ret);
+    SD_Flush();    // a volatile card cache loses data without it
+    SDWake();
+    g->sdio->POWER = SDIO_PowerState_OFF;
     return SD_OK;
 }
 static SD_Error CmdResp2Error(void)
 {
     SD_Error ret = SD_OK;
     u32_t status;
-    status = SDIO->STA;
-    while(!(status
-            & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CTIMEOUT | SDIO_FLAG_CMDREND))) {
-        status = SDIO->STA;
-    }
+    status = SDWaitResp();
     if(status & SDIO_FLAG_CTIMEOUT) {
-        SDIO_ClearFlag(SDIO_FLAG_CTIMEOUT);
+        SDIO_ClearFlagEx(SDIO_FLAG_CTIMEOUT);
         return SD_CMD_RSP_TIMEOUT;
     }
     else if(status & SDIO_FLAG_CCRCFAIL) {
-        SDIO_ClearFlag(SDIO_FLAG_CCRCFAIL);
+        SDIO_ClearFlagEx(SDIO_FLAG_CCRCFAIL);
         return SD_CMD_CRC_FAIL;
     }
-    SDIO_ClearFlag(SDIO_STATIC_FLAGS); /* Clear all the static flags */
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS); /* Clear all the static flags */
     return (ret);
 }
 static SD_Error CmdResp6Error(u8_t cmd, u16_t* prca)
@@ -404,23 +734,19 @@ static SD_Error CmdResp6Error(u8_t cmd, u16_t* prca)
     SD_Error ret = SD_OK;
     u32_t status;
     u32_t resp_r1;
-    status = SDIO->STA;
-    while(!(status
-            & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CTIMEOUT | SDIO_FLAG_CMDREND))) {
-        status = SDIO->STA;
-    }
+    status = SDWaitResp();
     if(status & SDIO_FLAG_CTIMEOUT) {
-        SDIO_ClearFlag(SDIO_FLAG_CTIMEOUT);
+        SDIO_ClearFlagEx(SDIO_FLAG_CTIMEOUT);
         return SD_CMD_RSP_TIMEOUT;
     }
     else if(status & SDIO_FLAG_CCRCFAIL) {
-        SDIO_ClearFlag(SDIO_FLAG_CCRCFAIL);
+        SDIO_ClearFlagEx(SDIO_FLAG_CCRCFAIL);
         return SD_CMD_CRC_FAIL;
     }
-    if(SDIO_GetCommandResponse() != cmd)    // Check response received is of desired command
+    if(SDIO_GetCommandResponseEx() != cmd)    // Check response received is of desired command
         return SD_ILLEGAL_CMD;
-    SDIO_ClearFlag(SDIO_STATIC_FLAGS);    // Clear all the static flags
-    resp_r1 = SDIO_GetResponse(SDIO_RESP1);    // received response, retrieve it.  */
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);    // Clear all the static flags
+    resp_r1 = SDIO_GetResponseEx(SDIO_RESP1);    // received response, retrieve it.  */
     if((resp_r1
             & (SD_R6_GENERAL_UNKNOWN_ERROR | SD_R6_ILLEGAL_CMD
                     | SD_R6_COM_CRC_FAILED)) == SD_ALLZERO) {
@@ -436,32 +762,73 @@ static SD_Error CmdResp6Error(u8_t cmd, u16_t* prca)
     return (ret);
 }
 
+static SD_Error CmdResp5Error(u8_t cmd, u8_t* pdata)
+{
+    SD_Error ret = SD_OK;
+    u32_t status;
+    u32_t resp_r5;
+    status = SDWaitResp();
+    if(status & SDIO_FLAG_CTIMEOUT) {
+        SDIO_ClearFlagEx(SDIO_FLAG_CTIMEOUT);
+        return SD_CMD_RSP_TIMEOUT;
+    }
+    else if(status & SDIO_FLAG_CCRCFAIL) {
+        SDIO_ClearFlagEx(SDIO_FLAG_CCRCFAIL);
+        return SD_CMD_CRC_FAIL;
+    }
+    if(SDIO_GetCommandResponseEx() != cmd)
+        return SD_ILLEGAL_CMD;
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
+    resp_r5 = SDIO_GetResponseEx(SDIO_RESP1);
+    if(pdata)
+        *pdata = (u8_t)resp_r5;
+    if(resp_r5 & SD_R6_COM_CRC_FAILED)
+        return (SD_COM_CRC_FAILED);
+    if(resp_r5 & SD_R6_ILLEGAL_CMD)
+        return (SD_ILLEGAL_CMD);
+    if(resp_r5 & SD_R5_ERROR)
+        return (SD_GENERAL_UNKNOWN_ERROR);
+    if(resp_r5 & SD_R5_FUNCTION_NUMBER)
+        return (SD_SDIO_UNKNOWN_FUNCTION);
+    if(resp_r5 & SD_R5_OUT_OF_RANGE)
+        return (SD_ADDR_OUT_OF_RANGE);
+    return (ret);
+}
+
 SD_Error SD_InitializeCards(void)
 {
     SD_Error ret = SD_OK;
     u16_t rca = 0x1;
-    if(SDIO_GetPowerState() == SDIO_PowerState_OFF)
+    if((g->sdio->POWER & 3) == SDIO_PowerState_OFF)
         return SD_REQUEST_NOT_APPLICABLE;
-    if(SDTYPE_SDIO != g.type) {
+    if(SDTYPE_SDIO != g->type) {
         SDIO_SendCmdEx(CMD2, 0x0, SDIO_Response_Long | SDIO_CPSM_Enable); /* Send CMD2 ALL_SEND_CID */
         ret = CmdResp2Error();
         if(SD_OK != ret)
             return (ret);
-        g.cid[0] = SDIO_GetResponse(SDIO_RESP1);
-        g.cid[1] = SDIO_GetResponse(SDIO_RESP2);
-        g.cid[2] = SDIO_GetResponse(SDIO_RESP3);
-        g.cid[3] = SDIO_GetResponse(SDIO_RESP4);
+        g->cid[0] = SDIO_GetResponseEx(SDIO_RESP1);
+        g->cid[1] = SDIO_GetResponseEx(SDIO_RESP2);
+        g->cid[2] = SDIO_GetResponseEx(SDIO_RESP3);
+        g->cid[3] = SDIO_GetResponseEx(SDIO_RESP4);
     }
-    if((SDTYPE_SDSC_V1_1 == g.type) || (SDTYPE_SDSC_V2_0 == g.type)
-            || (SDTYPE_SDIO_COMBO == g.type) || (SDTYPE_SDHC == g.type)) {
+    if((SDTYPE_SDSC_V1_1 == g->type) || (SDTYPE_SDSC_V2_0 == g->type)
+            || (SDTYPE_SDIO_COMBO == g->type) || (SDTYPE_SDHC == g->type)
+            || (SDTYPE_SDIO == g->type)) {
         /* Send CMD3 SET_REL_ADDR with argument 0, get rca */
         SDIO_SendCmdEx(CMD3, 0x0, CMD_EX_DEFAULT);
         ret = CmdResp6Error(CMD3, &rca);
         if(SD_OK != ret)
             return (ret);
     }
-    if(SDTYPE_SDIO != g.type) {
-        g.rca = rca;
+    else if(IS_MMC) {
+        /* MMC: the host assigns the rca */
+        SDIO_SendCmdEx(CMD3, (u32_t)rca << 16, CMD_EX_DEFAULT);
+        ret = CmdResp1Error(CMD3);
+        if(SD_OK != ret)
+            return (ret);
+    }
+    g->rca = rca;
+    if(SDTYPE_SDIO != g->type) {
         /* Send CMD9 SEND_CSD with argument as card's RCA */
         SDIO_SendCmdEx(CMD9, (u32_t)(rca << 16),
                 SDIO_Response_Long | SDIO_CPSM_Enable);
@@ -469,10 +836,10 @@ SD_Error SD_InitializeCards(void)
         if(SD_OK != ret) {
             return (ret);
         }
-        g.csd[0] = SDIO_GetResponse(SDIO_RESP1);
-        g.csd[1] = SDIO_GetResponse(SDIO_RESP2);
-        g.csd[2] = SDIO_GetResponse(SDIO_RESP3);
-        g.csd[3] = SDIO_GetResponse(SDIO_RESP4);
+        g->csd[0] = SDIO_GetResponseEx(SDIO_RESP1);
+        g->csd[1] = SDIO_GetResponseEx(SDIO_RESP2);
+        g->csd[2] = SDIO_GetResponseEx(SDIO_RESP3);
+        g->csd[3] = SDIO_GetResponseEx(SDIO_RESP4);
     }
     ret = SD_OK; /* All cards get intialized */
     return (ret);
@@ -480,7 +847,7 @@ SD_Error SD_InitializeCards(void)
 static SD_Error SDEnWideBus(void)
 {
     SD_Error ret = SD_OK;
-    SDIO_SendCmdEx(CMD55, g.rca << 16, CMD_EX_DEFAULT);
+    SDIO_SendCmdEx(CMD55, g->rca << 16, CMD_EX_DEFAULT);
     ret = CmdResp1Error(CMD55);
     if(ret != SD_OK)
         return (ret);
@@ -494,13 +861,13 @@ static SD_Error SDEnWideBus(void)
 static void SDIO_DMA_Config(void)
 {
     DMA_InitTypeDef dis;
-    DMA_Cmd(DMA2_Stream3, DISABLE); /* DMA2 Channel4 disable */
+    DMA_Cmd(g->dma, DISABLE); /* DMA2 Channel4 disable */
     dis.DMA_Channel = DMA_Channel_4;
 
     dis.DMA_FIFOMode = DMA_FIFOMode_Enable;
     dis.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
 
-    dis.DMA_PeripheralBaseAddr = (u32_t)&(SDIO->FIFO);
+    dis.DMA_PeripheralBaseAddr = (u32_t)&(g->sdio->FIFO);
     dis.DMA_PeripheralBurst = DMA_PeripheralBurst_INC4;
     dis.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
     dis.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
@@ -513,295 +880,1267 @@ static void SDIO_DMA_Config(void)
     dis.DMA_Mode = DMA_Mode_Circular;
     dis.DMA_Priority = DMA_Priority_High;
 //    dis.DMA_M2M = DMA_M2M_Disable;
-    DMA_Init(DMA2_Stream3, &dis);
-    DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3);
-    DMA_FlowControllerConfig(DMA2_Stream3, DMA_FlowCtrl_Peripheral);
+    DMA_Init(g->dma, &dis);
+    DMA_ClearFlag(g->dma, g->dma_tc);
+    DMA_FlowControllerConfig(g->dma, DMA_FlowCtrl_Peripheral);
+    g->dma_cr = g->dma->CR & ~(3 << 6);
 }
 
-SD_Error SD_Init(void)
+/* data path error flags, checked all through the data phase */
+static SD_Error SDDataError(void)
 {
-    SD_Error status = SD_OK;
-    RCC_APB2PeriphClockCmd(RCC_APB2Periph_SDIO, ENABLE);
-    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
-    _dbg();
-    SDIO_DeInit();
-    _dbg();
-    status = SD_PowerON();
-    _dbg();
-    if(status != SD_OK)
-        return (status);    // 0
-    _dbg();
-    status = SD_InitializeCards();
-    _dbg();
-    if(status != SD_OK)
-        return (status);    // 1
-    _dbg();
-    SDIO_SetClockDiv(SDIO_TRANSFER_CLK_DIV);
-//    SDIO->CLKCR |= (1UL << 14); // enable flow ctrl
-    _dbg();
-    SDIO_DMA_Config();
-    _dbg();
-    SDIO_SendCmdEx(CMD7, g.rca << 16, CMD_EX_DEFAULT);
-    if((g.csd[0] >> 30) == 0x0) {    // csd v1.0
-        u32_t c_size = ((g.csd[1] << 2) | (g.csd[2] >> 30)) & 0xfff;
-        g.size = (c_size + 1) * (1 << (((g.csd[2] >> 15) & 0x7) + 2    // abc
-                + ((g.csd[1] >> 16) & 0xf) - 10));    // abc
+    u32_t sta = g->sdio->STA;
+#ifdef SD_FAULT_INJECT
+    if(fault)
+        sta = fault(SD_FAULT_AT_DATA, sta);
+#endif
+    if(!(sta & (SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT | SDIO_FLAG_TXUNDERR
+            | SDIO_FLAG_RXOVERR | SDIO_FLAG_STBITERR))) {
+        if(g->sdio->DCOUNT != g->data_left) {   // moving: a budget per block
+            g->data_left = g->sdio->DCOUNT;
+            g->data_end = SDDeadline(SD_DATA_TIMEOUT_MS);
+        }
+        else if(SDExpired(g->data_end)) {
+            g->tmo.data++;
+            return SD_DATA_TIMEOUT;
+        }
+        return SD_OK;
     }
-    else if((g.csd[0] >> 30) == 0x1) {    // csd v2.0
-        g.size = ((g.csd[1] << 16 | g.csd[2] >> 16) & 0x3fffff) * 512;
+    if(sta & SDIO_FLAG_RXOVERR) {
+        g->fifo.overruns++;
+        return SD_RX_OVERRUN;
     }
-    _dbg();
-    int ret;
-    ret = SDEnWideBus();
-    _dbg();
-    if(SD_OK != ret)
-        return (ret);
-    _dbg();
-    SDIO_SetBusWidth(SDIO_BusWide_4b);
-    _dbg();
-    SDIO_SendCmdEx(CMD16, 512, CMD_EX_DEFAULT);
-    _dbg();
-    ret = CmdResp1Error(CMD16);
-    _dbg();
-    if(SD_OK != ret)
-        return (ret);
-    return (status);
+    if(sta & SDIO_FLAG_TXUNDERR) {
+        g->fifo.underruns++;
+        return SD_TX_UNDERRUN;
+    }
+    if(sta & SDIO_FLAG_DCRCFAIL) {
+        g->fifo.crc++;
+        return SD_DATA_CRC_FAIL;
+    }
+    return (sta & SDIO_FLAG_DTIMEOUT) ? SD_DATA_TIMEOUT : SD_START_BIT_ERR;
 }
 
-static u8_t convert_from_bytes_to_power_of_two(u16_t nbytes)
+/* Stop a failed transfer: DMA, data path and the card, which may be left
+ * programming what it got of a write. CMD12 only while the card still
+ * sends or receives; once a single block or all blocks of a CMD23
+ * transfer are through it is illegal, and the next R1 would report it. */
+static SD_Error SDAbort(SD_Error ret)
 {
-    u8_t count = 0;
-    while(nbytes != 1) {
-        nbytes >>= 1;
-        count++;
+    u8_t cmd = g->sdio->CMD & 0x3f, state = 0;
+    DMA_Cmd(g->dma, DISABLE);
+    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
+            SDIO_DPSM_Disable);
+    SDIO_DMACmdEx(DISABLE);
+    if(g->type != SDTYPE_SDIO) {
+        IsCardProgramming(&state);  // 0 if no status came
+        if((state == SD_CARD_SENDING) || (state == SD_CARD_RECEIVING)
+                || (!state && ((cmd == CMD18) || (cmd == CMD25)))) {
+            SDIO_SendCmdEx(CMD12, 0, CMD_EX_DEFAULT);
+            if(CmdResp1Error(CMD12) == SD_CMD_RSP_TIMEOUT)
+                IsCardProgramming(&state);  // done meanwhile, clears the error
+        }
+        g->busy = true;
     }
-    return (count);
+    else    // ASx: the function of the CMD53 still in ARG
+        SD_IOWrite8(0, CCCR_IO_ABORT, (g->sdio->ARG >> 28) & 0x7);
+    g->pio.buf = NULL;
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
+    DMA_ClearFlag(g->dma, g->dma_tc);
+    return (ret);
 }
 
-SD_Error SD_ReadBlock(u32_t addr, void* readbuff, int nbytes)
+/* Arm the DMA for the data of a transfer, or leave it to SDDataWait()
+ * polling the FIFO: for short transfers, where arming the DMA costs more
+ * than moving the data, and for buffers the DMA cannot reach */
+static void SDDataStart(void* buf, u32_t nbytes, u32_t dir)
 {
-    SD_Error ret = SD_OK;
-    u8_t power = 0;
-    if(readbuff == NULL)
-        return SD_INVALID_PARAMETER;
-_dbg();
-    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
-            SDIO_DPSM_Disable);
-_dbg();
-    SDIO_DMACmd(DISABLE);
-_dbg();
-    if(SDIO_GetResponse(SDIO_RESP1) & SD_CARD_LOCKED)
-        return SD_LOCK_UNLOCK_FAILED;
-_dbg();
-    if(g.type == SDTYPE_SDHC) {
-        nbytes = 512;
-        addr /= 512;
+    g->data_end = SDDeadline(SD_DATA_TIMEOUT_MS);
+    g->data_left = nbytes;
+    if((nbytes <= pio_max) || DMA_UNREACHABLE(buf)) {
+        SDIO_DMACmdEx(DISABLE);
+        g->pio.buf = buf;
+        g->pio.nwords = nbytes / 4;
+        g->pio.write = (dir == DMA_DIR_MemoryToPeripheral);
+        return;
     }
-_dbg();
-    if((nbytes > 0) && (nbytes <= 2048) && ((nbytes & (nbytes - 1)) == 0))
-        power = convert_from_bytes_to_power_of_two(nbytes);
-    else
-        return SD_INVALID_PARAMETER;
-_dbg();
-    SDIO_DataCfgEx(nbytes, (u32_t)power << 4, SDIO_TransferDir_ToSDIO,
-            SDIO_DPSM_Enable);
-_dbg();
-    DMA_Cmd(DMA2_Stream3, DISABLE);
-    DMA2_Stream3->M0AR = (u32_t)readbuff;
-    DMA2_Stream3->NDTR = nbytes / 4;
-    DMA2_Stream3->CR = (DMA2_Stream3->CR & ~(3 << 6))
-            | DMA_DIR_PeripheralToMemory;
-    SDIO_DMACmd(ENABLE);
-    DMA_Cmd(DMA2_Stream3, ENABLE);
-_dbg();
-    SDIO_SendCmdEx(CMD17, addr, CMD_EX_DEFAULT);
-_dbg();
-    if(SDIO->STA & SDIO_FLAG_DTIMEOUT)
-        return SD_DATA_TIMEOUT;
-    if(SDIO->STA & SDIO_FLAG_DCRCFAIL)
-        return SD_DATA_CRC_FAIL;
-    if(SDIO->STA & SDIO_FLAG_RXOVERR)
-        return SD_RX_OVERRUN;
-_dbg();
-    ( {  while (DMA_GetFlagStatus(DMA2_Stream3, DMA_FLAG_TCIF3) == RESET)
-        _dbg();
+    g->pio.buf = NULL;
+    g->dma->CR = g->dma_cr | dir;
+    /* a stream finishes its current beat before EN reads 0, and ignores
+     * writes to M0AR and NDTR until then */
+    while((g->dma->CR & DMA_SxCR_EN) && !SDExpired(g->data_end))
+        ;
+    g->dma->M0AR = (u32_t)buf;
+    g->dma->NDTR = nbytes / 4;
+    SDIO_DMACmdEx(ENABLE);
+    g->dma->CR = g->dma_cr | dir | DMA_SxCR_EN;
+}
 
-        ;});
-_dbg();
-    DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3);
-_dbg();
-    ( {  while ((SDIO->STA & SDIO_FLAG_DATAEND) == RESET);});
-_dbg();
+/* Polled FIFO transfer: 8 words at a time on the half full / half empty
+ * flags, single words at the ends */
+static SD_Error SDPioMove(void)
+{
+    SD_Error ret = SD_OK;
+    u32_t* p = g->pio.buf;
+    u32_t n = g->pio.nwords, sta;
+    g->pio.buf = NULL;
+    while(n && (ret == SD_OK)) {
+        sta = g->sdio->STA;
+        if(g->pio.write) {
+            if((sta & SDIO_FLAG_TXFIFOHE) && (n >= SD_HALffIFO)) {
+                for(int i = 0; i < SD_HALffIFO; i++)
+                    g->sdio->FIFO = *p++;
+                n -= SD_HALffIFO;
+            }
+            else if(!(sta & SDIO_FLAG_TXFIFOF)) {
+                g->sdio->FIFO = *p++;
+                n--;
+            }
+        }
+        else {
+            if((sta & SDIO_FLAG_RXFIFOHF) && (n >= SD_HALffIFO)) {
+                for(int i = 0; i < SD_HALffIFO; i++)
+                    *p++ = g->sdio->FIFO;
+                n -= SD_HALffIFO;
+            }
+            else if(sta & SDIO_FLAG_RXDAVL) {
+                *p++ = g->sdio->FIFO;
+                n--;
+            }
+        }
+        ret = SDDataError();
+    }
+    while(!(g->sdio->STA & SDIO_FLAG_DATAEND) && (ret == SD_OK))
+        ret = SDDataError();
     return (ret);
 }
 
-SD_Error SD_ReadMultiBlocks(u32_t addr, void* readbuff, int nbytes, int nblocks)
+/* Wait for the DMA, or move the data by polling, and then for the end of
+ * the data, failing on the first error flag. Block transfers pass nbytes
+ * and report the bytes that reached memory (for reads up to 16 bytes may
+ * still sit in the FIFO); 0 for register reads and the like. */
+static SD_Error SDDataWait(u32_t nbytes)
 {
     SD_Error ret = SD_OK;
-    u8_t power = 0;
-    if(NULL == readbuff)
-        return SD_INVALID_PARAMETER;
-    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
-            SDIO_DPSM_Disable);
-    SDIO_DMACmd(DISABLE);
-    if(SDIO_GetResponse(SDIO_RESP1) & SD_CARD_LOCKED)
-        return SD_LOCK_UNLOCK_FAILED;
-    if(g.type == SDTYPE_SDHC) {
-        nbytes = 512;
-        addr /= 512;
-    }
-    if((nbytes > 0) && (nbytes <= 2048) && (0 == (nbytes & (nbytes - 1)))) {
-        power = convert_from_bytes_to_power_of_two(nbytes);
-        SDIO_SendCmdEx(CMD16, nbytes, CMD_EX_DEFAULT);
-        ret = CmdResp1Error(CMD16);
-        if(SD_OK != ret)
-            return (ret);
+    u32_t done;
+    if(g->pio.buf) {
+        ret = SDPioMove();
+        if((ret == SD_OK) && nbytes && g->progress)
+            g->progress(nbytes);
+        return (ret);
     }
-    else
-        return SD_INVALID_PARAMETER;
-    if(nblocks > 1) {
-        if(nblocks * nbytes > SD_MAX_DATA_LENGTH)
-            return SD_INVALID_PARAMETER;
-        SDIO_DataCfgEx(nbytes * nblocks, (u32_t)power << 4,
-                SDIO_TransferDir_ToSDIO, SDIO_DPSM_Enable);
-        SDIO_SendCmdEx(CMD18, addr, CMD_EX_DEFAULT);
-        ret = CmdResp1Error(CMD18);
+    while(DMA_GetFlagStatus(g->dma, g->dma_tc) == RESET) {
+        ret = SDDataError();
         if(ret != SD_OK)
             return (ret);
-        DMA_Cmd(DMA2_Stream3, DISABLE);
-        DMA2_Stream3->M0AR = (u32_t)readbuff;
-        DMA2_Stream3->NDTR = nbytes * nblocks / 4;
-        DMA2_Stream3->CR = (DMA2_Stream3->CR & ~(3 << 6))
-                | DMA_DIR_PeripheralToMemory;
-        SDIO_DMACmd(ENABLE);
-        DMA_Cmd(DMA2_Stream3, ENABLE);
-        ( {  while (DMA_GetFlagStatus(DMA2_Stream3, DMA_FLAG_TCIF3) == RESET);});
-        DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3);
-        ( {  while ((SDIO->STA & SDIO_FLAG_DATAEND) == RESET);});
-        SDIO_SendCmdEx(CMD12, 0, CMD_EX_DEFAULT);    // stop transmission
-        ret = CmdResp1Error(CMD12);
-        if(ret != SD_OK)
-            return ret;
+        if(nbytes && g->progress) {
+            done = nbytes - g->dma->NDTR * 4;
+            g->progress(done > 16 ? done - 16 : 0);
+        }
     }
+    DMA_ClearFlag(g->dma, g->dma_tc);
+    if(nbytes && g->progress)
+        g->progress(nbytes);
+    while(!(g->sdio->STA & SDIO_FLAG_DATAEND) && (ret == SD_OK))
+        ret = SDDataError();
     return (ret);
 }
 
-SD_Error SD_WriteBlock(unsigned long addr, void* writebuff, int nbytes)
+static u8_t convert_from_bytes_to_power_of_two(u16_t nbytes)
 {
-    SD_Error ret = SD_OK;
-    u8_t power = 0, state = 0;
-    u32_t timeout = 0;
-    u32_t cardstatus = 0;
-    if(writebuff == NULL)
-        return SD_INVALID_PARAMETER;
-    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
-            SDIO_DPSM_Disable);
-    SDIO_DMACmd(DISABLE);
-    if(SDIO_GetResponse(SDIO_RESP1) & SD_CARD_LOCKED)
-        return SD_LOCK_UNLOCK_FAILED;
-    if(g.type == SDTYPE_SDHC) {
-        nbytes = 512;
-        addr /= 512;
-    }
+    u8_t count = 0;
+    while(nbytes != 1) {
+        nbytes >>= 1;
+        count++;
+    }
+    return (count);
+}
+
+/* Read a short data block returned by a register-style command (SD Status,
+ * SCR, ...). For ACMDs the caller sends CMD55 first, after
+ * SDWaitProgrammed(): its CMD13 must not come between the two. */
+static SD_Error SDReadData(u8_t cmd, u32_t arg, void* buf, int nbytes)
+{
+    SD_Error ret = SD_OK;
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_DataCfgEx(nbytes, (u32_t)convert_from_bytes_to_power_of_two(nbytes) << 4,
+            SDIO_TransferDir_ToSDIO, SDIO_DPSM_Enable);
+    SDDataStart(buf, nbytes, DMA_DIR_PeripheralToMemory);
+    SDIO_SendCmdEx(cmd, arg, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(cmd);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    ret = SDDataWait(0);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
+    return (ret);
+}
+
+/* 512 bit SD Status (ACMD13), buff must hold 64 bytes */
+SD_Error SD_ReadSDStatus(void* buff)
+{
+    SD_Error ret = SD_OK;
+    if(buff == NULL)
+        return SD_INVALID_PARAMETER;
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SendCmdEx(CMD55, g->rca << 16, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(CMD55);
+    if(ret != SD_OK)
+        return (ret);
+    return SDReadData(ACMD13, 0, buff, 64);
+}
+
+/* allocation unit in kbytes, 0 if the card does not report one */
+u32_t SD_GetAUSize(void)
+{
+    return g->au;
+}
+
+/* capacity in kbytes */
+u32_t SD_GetCardSize(void)
+{
+    return g->size;
+}
+
+/* Counterpart of SDReadData for commands that take a data block and
+ * leave the card busy, e.g. CMD49 */
+static SD_Error SDWriteData(u8_t cmd, u32_t arg, void* buf, int nbytes)
+{
+    SD_Error ret = SD_OK;
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SendCmdEx(cmd, arg, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(cmd);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    SDIO_DataCfgEx(nbytes, (u32_t)convert_from_bytes_to_power_of_two(nbytes) << 4,
+            SDIO_TransferDir_ToCard, SDIO_DPSM_Enable);
+    SDDataStart(buf, nbytes, DMA_DIR_MemoryToPeripheral);
+    ret = SDDataWait(0);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
+    return SDBusyWait(SD_BUSY_TIMEOUT_MS);
+}
+
+/* CMD48 READ_EXTR_SINGLE / CMD49 WRITE_EXTR_SINGLE on the performance
+ * enhancement register page. Both move a 512 byte block. */
+static SD_Error SDPerfRead(u32_t off, u32_t len, void* buf)
+{
+    return SDReadData(CMD48, g->perf | ((g->perf_off + off) << 9) | (len - 1),
+            buf, 512);
+}
+
+static SD_Error SDPerfWrite(u32_t off, u8_t val)
+{
+    u32_t blk[128] = {val};
+    return SDWriteData(CMD49, g->perf | ((g->perf_off + off) << 9), blk, 512);
+}
+
+/* Find the performance enhancement extension (SFC 2) in the general
+ * information page and read its capabilities */
+static SD_Error SDReadPerfRegs(void)
+{
+    SD_Error ret = SD_OK;
+    u32_t page[128];
+    u8_t* b = (u8_t*)page;
+    u32_t addr = 16, ext;
+    g->perf_caps = 0;
+    ret = SDReadData(CMD48, 511, page, 512);    // fno 0, page 0, 512 bytes
+    if(ret != SD_OK)
+        return (ret);
+    if((b[0] | b[1]) != 0)    // revision
+        return SD_UNSUPPORTED_FEATURE;
+    for(u32_t n = b[4]; n && (addr <= 512 - 48); n--) {
+        ext = b[addr + 44] | b[addr + 45] << 8 | b[addr + 46] << 16
+                | (u32_t)b[addr + 47] << 24;
+        if(((b[addr] | b[addr + 1] << 8) == 0x2) && (b[addr + 42] == 1)) {
+            g->perf = ((ext >> 18) & 0xf) << 27 | ((ext >> 9) & 0xff) << 18;
+            g->perf_off = ext & 0x1ff;
+            ret = SDPerfRead(0, 512, page);
+            if(ret != SD_OK)
+                return (ret);
+            g->perf_caps = (b[0] & 1) | (b[1] & 1) << 1 | (b[2] & 1) << 2
+                    | (b[4] & 1) << 3 | ((b[6] & 0x1f) ? SD_PERF_CQ : 0);
+            g->cq.max = (b[6] & 0x1f) ? (b[6] & 0x1f) + 1 : 0;    // depth - 1
+            return (ret);
+        }
+        addr = b[addr + 40] | b[addr + 41] << 8;
+    }
+    return SD_UNSUPPORTED_FEATURE;
+}
+
+u32_t SD_GetPerfCaps(void)
+{
+    return g->perf_caps;
+}
+
+SD_Error SD_CacheCtrl(bool enable)
+{
+    SD_Error ret = SD_OK;
+    if(!(g->perf_caps & SD_PERF_CACHE))
+        return SD_UNSUPPORTED_FEATURE;
+    if(!enable)
+        ret = SD_Flush();
+    if(ret == SD_OK)
+        ret = SDPerfWrite(PERF_CACHE_EN, enable);
+    if(ret == SD_OK)
+        g->cache = enable;
+    return (ret);
+}
+
+/* The card clears the flush bit once its cache is on flash */
+SD_Error SD_Flush(void)
+{
+    SD_Error ret = SD_OK;
+    u32_t reg[128];
+    if(!g->cache)
+        return (ret);
+    ret = SDPerfWrite(PERF_FLUSH, 1);
+    if(ret != SD_OK)
+        return (ret);
+    ret = SDPerfRead(PERF_FLUSH, 1, reg);
+    if((ret == SD_OK) && (reg[0] & 1))
+        return SD_DATA_TIMEOUT;
+    return (ret);
+}
+
+static SD_Error SDIOCmd52(bool write, u8_t func, u32_t addr, u8_t* data)
+{
+    SDIO_SendCmdEx(CMD52, ((u32_t)write << 31) | ((u32_t)func << 28)
+            | ((addr & 0x1ffff) << 9) | (write ? *data : 0), CMD_EX_DEFAULT);
+    return CmdResp5Error(CMD52, data);
+}
+
+SD_Error SD_IORead8(u8_t func, u32_t addr, u8_t* data)
+{
+    if(data == NULL)
+        return SD_INVALID_PARAMETER;
+    return SDIOCmd52(false, func, addr, data);
+}
+
+SD_Error SD_IOWrite8(u8_t func, u32_t addr, u8_t data)
+{
+    return SDIOCmd52(true, func, addr, &data);
+}
+
+/* CMD53: whole blocks of the function's block size go in block mode,
+ * other power of two lengths up to 512 bytes in byte mode */
+static SD_Error SDIOCmd53(bool write, u8_t func, u32_t addr, void* buff,
+        u32_t nbytes, bool incr)
+{
+    SD_Error ret = SD_OK;
+    u32_t blksz = g->io.blksz[func & 7];
+    u32_t arg = ((u32_t)write << 31) | ((u32_t)func << 28)
+            | ((u32_t)incr << 26) | ((addr & 0x1ffff) << 9);
+    if((buff == NULL) || ((u32_t)buff & 3) || (func > g->io.nfunc))
+        return SD_INVALID_PARAMETER;
+    if(blksz && (nbytes % blksz == 0) && (nbytes / blksz <= 511))
+        arg |= _BV(27) | (nbytes / blksz);
+    else if((nbytes >= 4) && (nbytes <= 512) && ((nbytes & (nbytes - 1)) == 0)) {
+        blksz = nbytes;
+        arg |= nbytes & 0x1ff;    // 512 is encoded as 0
+    }
+    else
+        return SD_INVALID_PARAMETER;
+    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
+            SDIO_DPSM_Disable);
+    SDDataStart(buff, nbytes,
+            write ? DMA_DIR_MemoryToPeripheral : DMA_DIR_PeripheralToMemory);
+    if(!write)
+        SDIO_DataCfgEx(nbytes,
+                (u32_t)convert_from_bytes_to_power_of_two(blksz) << 4,
+                SDIO_TransferDir_ToSDIO, SDIO_DPSM_Enable);
+    SDIO_SendCmdEx(CMD53, arg, CMD_EX_DEFAULT);
+    ret = CmdResp5Error(CMD53, NULL);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    if(write)
+        SDIO_DataCfgEx(nbytes,
+                (u32_t)convert_from_bytes_to_power_of_two(blksz) << 4,
+                SDIO_TransferDir_ToCard, SDIO_DPSM_Enable);
+    ret = SDDataWait(0);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
+    return (ret);
+}
+
+static SD_Error SDIOTransfer(bool write, u8_t func, u32_t addr, void* buff,
+        u32_t nbytes, bool incr)
+{
+#ifdef SD_TRACE
+    u32_t start = DWT->CYCCNT;
+    SD_Error ret = SDIOCmd53(write, func, addr, buff, nbytes, incr);
+    SD_TraceAdd(write ? SD_TRACE_IO_WRITE : SD_TRACE_IO_READ,
+            ((u32_t)func << 17) | (addr & 0x1ffff), nbytes, start, ret,
+            g - cards);
+    return (ret);
+#else
+    return SDIOCmd53(write, func, addr, buff, nbytes, incr);
+#endif
+}
+
+SD_Error SD_IORead(u8_t func, u32_t addr, void* buff, u32_t nbytes, bool incr)
+{
+    return SDIOTransfer(false, func, addr, buff, nbytes, incr);
+}
+
+SD_Error SD_IOWrite(u8_t func, u32_t addr, const void* buff, u32_t nbytes,
+        bool incr)
+{
+    return SDIOTransfer(true, func, addr, (void*)buff, nbytes, incr);
+}
+
+SD_Error SD_IOEnableFunc(u8_t func)
+{
+    SD_Error ret = SD_OK;
+    u32_t timeout = SD_DATATIMEOUT;
+    u8_t v = 0;
+    if((func == 0) || (func > g->io.nfunc))
+        return SD_SDIO_UNKNOWN_FUNCTION;
+    ret = SD_IORead8(0, CCCR_IO_ENABLE, &v);
+    if(ret != SD_OK)
+        return (ret);
+    ret = SD_IOWrite8(0, CCCR_IO_ENABLE, v | (1 << func));
+    if(ret != SD_OK)
+        return (ret);
+    do {
+        ret = SD_IORead8(0, CCCR_IO_READY, &v);
+    } while((ret == SD_OK) && !(v & (1 << func)) && --timeout);
+    if(timeout == 0)
+        return SD_SDIO_FUNCTION_BUSY;
+    return (ret);
+}
+
+/* handler runs in interrupt context; NVIC setup is up to the caller */
+SD_Error SD_IOIrqEnable(u8_t func, void (*handler)(void))
+{
+    SD_Error ret = SD_OK;
+    u8_t v = 0;
+    if((func == 0) || (func > g->io.nfunc))
+        return SD_SDIO_UNKNOWN_FUNCTION;
+    ret = SD_IORead8(0, CCCR_INT_ENABLE, &v);
+    if(ret != SD_OK)
+        return (ret);
+    g->io.irq = handler;
+    SDPwrSav();
+    ret = SD_IOWrite8(0, CCCR_INT_ENABLE, v | 0x1 | (1 << func));    // IENM
+    if(ret != SD_OK)
+        return (ret);
+    g->sdio->DCTRL |= _BV(11);    // SDIOEN: sample DAT1 interrupts
+    SDIO_ClearFlagEx(SDIO_FLAG_SDIOIT);
+    g->sdio->MASK |= SDIO_FLAG_SDIOIT;
+    return (ret);
+}
+
+/* call from SDIO_IRQHandler */
+void SD_IOIrqHandler(void)
+{
+    if(g->sdio->STA & SDIO_FLAG_SDIOIT) {
+        SDIO_ClearFlagEx(SDIO_FLAG_SDIOIT);
+        if(g->io.irq)
+            g->io.irq();
+    }
+}
+
+void SD_IOGetInfo(u8_t* nfunc, u16_t* manf, u16_t* card)
+{
+    if(nfunc)
+        *nfunc = g->io.nfunc;
+    if(manf)
+        *manf = g->io.manf;
+    if(card)
+        *card = g->io.card;
+}
+
+static SD_Error SDIOReadLE(u32_t addr, int n, u32_t* val)
+{
+    SD_Error ret = SD_OK;
+    u8_t b = 0;
+    *val = 0;
+    for(int i = 0; (i < n) && (ret == SD_OK); i++) {
+        ret = SD_IORead8(0, addr + i, &b);
+        *val |= (u32_t)b << (8 * i);
+    }
+    return (ret);
+}
+
+/* walk the function's CIS for MANFID and FUNCE, then program the largest
+ * power of two block size it can take (up to 512) into the FBR, 512 when
+ * the CIS has no FUNCE tuple to say otherwise */
+static SD_Error SDIOReadCIS(u8_t func)
+{
+    SD_Error ret = SD_OK;
+    u32_t ptr = 0, maxblk = 512, v = 0;
+    u8_t code = 0, link = 0;
+    ret = SDIOReadLE(func * 0x100 + CCCR_CIS_PTR, 3, &ptr);
+    for(int n = 0; (ret == SD_OK) && (n < 32); n++) {
+        ret = SD_IORead8(0, ptr, &code);
+        if((ret != SD_OK) || (code == CISTPL_END))
+            break;
+        ret = SD_IORead8(0, ptr + 1, &link);
+        if(ret != SD_OK)
+            break;
+        if((code == CISTPL_MANFID) && (func == 0)) {
+            ret = SDIOReadLE(ptr + 2, 4, &v);
+            g->io.manf = v & 0xffff;
+            g->io.card = v >> 16;
+        }
+        else if(code == CISTPL_FUNCE) {
+            ret = SDIOReadLE(ptr + 2 + (func ? 12 : 1), 2, &maxblk);
+        }
+        if(link == 0xff)
+            break;
+        ptr += 2 + link;
+    }
+    if(ret != SD_OK)
+        return (ret);
+    for(v = 512; (v > maxblk) && (v > 4); v >>= 1)
+        ;
+    g->io.blksz[func] = v;
+    ret = SD_IOWrite8(0, func * 0x100 + FBR_BLKSIZE, v & 0xff);
+    if(ret == SD_OK)
+        ret = SD_IOWrite8(0, func * 0x100 + FBR_BLKSIZE + 1, v >> 8);
+    return (ret);
+}
+
+static SD_Error SDIOInit(void)
+{
+    SD_Error ret = SD_OK;
+    u8_t caps = 0, bus = 0;
+    ret = SD_IORead8(0, CCCR_CAPS, &caps);
+    if(ret != SD_OK)
+        return (ret);
+    if(!(caps & 0x40) || (caps & 0x80)) {    // not low speed, or 4BLS
+        ret = SD_IORead8(0, CCCR_BUS_IF, &bus);
+        if(ret == SD_OK)
+            ret = SD_IOWrite8(0, CCCR_BUS_IF, (bus & ~0x3) | 0x2);
+        if(ret != SD_OK)
+            return (ret);
+        SDIO_SetBusWidth(SDIO_BusWide_4b);
+    }
+    for(u8_t f = 0; (f <= g->io.nfunc) && (ret == SD_OK); f++)
+        ret = SDIOReadCIS(f);
+    return (ret);
+}
+
+/* Command queue: tasks are announced with CMD44/CMD45 and run with
+ * CMD46/CMD47 in whatever order the card reports them ready, so the card
+ * can work on queued tasks while the bus moves data for another. */
+SD_Error SD_QueueEnable(u32_t depth)
+{
+    SD_Error ret = SD_OK;
+    if(!(g->perf_caps & SD_PERF_CQ) || !BLOCK_ADDRESSED)
+        return SD_UNSUPPORTED_FEATURE;
+    if((depth > g->cq.max) || (depth > SD_CQ_DEPTH))
+        return SD_INVALID_PARAMETER;
+    if(g->cq.busy)
+        return SD_REQUEST_PENDING;
+    ret = SDPerfWrite(PERF_CQ_EN, depth != 0);
+    if(ret == SD_OK)
+        g->cq.depth = depth;
+    return (ret);
+}
+
+SD_Error SD_QueueSubmit(bool write, u32_t lba, void* buff, u32_t nblocks,
+        u8_t* ptag)
+{
+    SD_Error ret = SD_OK;
+    u8_t tag = 0;
+    if(g->cq.depth == 0)
+        return SD_REQUEST_NOT_APPLICABLE;
+    if((buff == NULL) || ((u32_t)buff & 3) || (nblocks == 0)
+            || (nblocks > 0xffff))
+        return SD_INVALID_PARAMETER;
+    while((tag < g->cq.depth) && (g->cq.busy & (1UL << tag)))
+        tag++;
+    if(tag == g->cq.depth)
+        return SD_REQUEST_PENDING;    // queue full
+    ret = SDWaitProgrammed();    // an abort (R1b) or a posted write
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SendCmdEx(CMD44, ((u32_t)!write << 30) | ((u32_t)tag << 16) | nblocks,
+            CMD_EX_DEFAULT);    // Q_TASK_INFO_A: direction, id, count
+    ret = CmdResp1Error(CMD44);
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SendCmdEx(CMD45, lba, CMD_EX_DEFAULT);    // Q_TASK_INFO_B: address
+    ret = CmdResp1Error(CMD45);
+    if(ret != SD_OK)
+        return (ret);
+    g->cq.task[tag].buf = buff;
+    g->cq.task[tag].lba = lba;
+    g->cq.task[tag].start = DWT->CYCCNT;
+    g->cq.task[tag].nblocks = nblocks;
+    g->cq.task[tag].write = write;
+    g->cq.busy |= 1UL << tag;
+    g->cq.queued |= 1UL << tag;
+    *ptag = tag;
+    return (ret);
+}
+
+static SD_Error SDQueueExec(u8_t tag)
+{
+    SD_Error ret = SD_OK;
+    void* buff = g->cq.task[tag].buf;
+    u32_t nbytes = g->cq.task[tag].nblocks * 512;
+    bool write = g->cq.task[tag].write;
+    u8_t cmd = write ? CMD47 : CMD46;
+    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
+            SDIO_DPSM_Disable);
+    SDDataStart(buff, nbytes,
+            write ? DMA_DIR_MemoryToPeripheral : DMA_DIR_PeripheralToMemory);
+    if(!write)
+        SDIO_DataCfgEx(nbytes, 9 << 4, SDIO_TransferDir_ToSDIO,
+                SDIO_DPSM_Enable);
+    SDIO_SendCmdEx(cmd, (u32_t)tag << 16, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(cmd);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    if(write)
+        SDIO_DataCfgEx(nbytes, 9 << 4, SDIO_TransferDir_ToCard,
+                SDIO_DPSM_Enable);
+    ret = SDDataWait(0);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    SDIO_ClearFlagEx(SDIO_STATIC_FLAGS);
+    return (ret);    // no wait for programming, the queue goes on
+}
+
+/* CMD43 Q_MANAGEMENT: drop a task that failed, the card would still
+ * hold it as queued and report it ready again; the next queue call waits
+ * out its busy */
+static void SDQueueAbort(u8_t tag)
+{
+    SDIO_SendCmdEx(CMD43, ((u32_t)tag << 16) | 0x2, CMD_EX_DEFAULT);
+    if(CmdResp1Error(CMD43) == SD_OK)
+        g->busy = true;    // R1b
+}
+
+/* Run one task the card reports ready. SD_REQUEST_PENDING: none ready */
+SD_Error SD_QueueRun(void)
+{
+    SD_Error ret = SD_OK;
+    u32_t ready;
+    u8_t tag = 0;
+    if(g->cq.queued == 0)
+        return (ret);
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SendCmdEx(CMD13, (g->rca << 16) | _BV(15), CMD_EX_DEFAULT);    // SQS
+    ret = CmdResp1Frame(CMD13);    // the argument is the QSR, not a status
+    if(ret != SD_OK)
+        return (ret);
+    ready = SDIO_GetResponseEx(SDIO_RESP1) & g->cq.queued;
+    if(ready == 0)
+        return SD_REQUEST_PENDING;
+    while(!(ready & (1UL << tag)))
+        tag++;
+    g->cq.task[tag].ret = SDQueueExec(tag);
+    g->cq.queued &= ~(1UL << tag);
+    if(g->cq.task[tag].ret != SD_OK)
+        SDQueueAbort(tag);
+#ifdef SD_TRACE
+    SD_TraceAdd(g->cq.task[tag].write ? SD_TRACE_WRITE : SD_TRACE_READ,
+            g->cq.task[tag].lba, g->cq.task[tag].nblocks,
+            g->cq.task[tag].start, g->cq.task[tag].ret, g - cards);
+#endif
+    return (ret);
+}
+
+/* Result of a task, SD_REQUEST_PENDING until it ran; frees the slot */
+SD_Error SD_QueueStatus(u8_t tag)
+{
+    if((tag >= SD_CQ_DEPTH) || !(g->cq.busy & (1UL << tag)))
+        return SD_INVALID_PARAMETER;
+    if(g->cq.queued & (1UL << tag))
+        return SD_REQUEST_PENDING;
+    g->cq.busy &= ~(1UL << tag);
+    return g->cq.task[tag].ret;
+}
+
+/* blocking request on top of the queue, used by the classic API; the
+ * queue needs a block addressed card, so the command argument is the lba */
+static SD_Error SDQueueSync(bool write, u32_t lba, void* buff, u32_t nblocks)
+{
+    SD_Error ret = SD_OK, run;
+    u8_t tag = 0;
+    while((ret = SD_QueueSubmit(write, lba, buff, nblocks, &tag))
+            == SD_REQUEST_PENDING) {
+        if(g->cq.queued == 0)
+            return (ret);    // full of results nobody collected
+        run = SD_QueueRun();
+        if((run != SD_OK) && (run != SD_REQUEST_PENDING))
+            return (run);
+    }
+    if(ret != SD_OK)
+        return (ret);
+    while((ret = SD_QueueStatus(tag)) == SD_REQUEST_PENDING) {
+        run = SD_QueueRun();
+        if((run != SD_OK) && (run != SD_REQUEST_PENDING))
+            return (run);
+    }
+    return (ret);
+}
+
+static SD_Error MMCSwitch(u8_t index, u8_t value)
+{
+    SD_Error ret = SD_OK;
+    SDIO_SendCmdEx(CMD6, (3UL << 24) | ((u32_t)index << 16) | ((u32_t)value << 8),
+            CMD_EX_DEFAULT);    // write byte
+    ret = CmdResp1Error(CMD6);
+    if(ret != SD_OK)
+        return (ret);
+    ret = SDBusyWait(SD_BUSY_TIMEOUT_MS);
+    if((ret == SD_OK) && (SDIO_GetResponseEx(SDIO_RESP1) & MMC_SWITCH_ERROR))
+        return SD_SWITCH_ERROR;
+    return (ret);
+}
+
+/* Erase group and time per group. The high capacity group holds only once
+ * ERASE_GROUP_DEF is set, read back to be sure; else the CSD group does,
+ * with no erase timeout given. TRIM (SEC_FEATURE_SUPPORT bit 4) frees
+ * write blocks within TRIM_MULT time per group; ext_csd is reused. */
+static void MMCEraseGroups(u32_t* ext_csd)
+{
+    u8_t* ext = (u8_t*)ext_csd;
+    u32_t hc = ext[EXT_CSD_HC_ERASE_GRP_SIZE], trim = ext[EXT_CSD_TRIM_MULT];
+    u32_t erase = ext[EXT_CSD_ERASE_TIMEOUT_MULT];
+    bool def = ext[EXT_CSD_ERASE_GROUP_DEF] & 0x1;
+    g->mmc_trim = (ext[EXT_CSD_SEC_FEATURE_SUPPORT] & 0x10) != 0;
+    if(hc && !def && (MMCSwitch(EXT_CSD_ERASE_GROUP_DEF, 1) == SD_OK))
+        def = (SDReadData(CMD8, 0, ext_csd, 512) == SD_OK)
+                && (ext[EXT_CSD_ERASE_GROUP_DEF] & 0x1);
+    if(hc && def) {
+        g->erase_unit = hc * 1024;    // 512 KiB units
+        g->erase_ms = (g->mmc_trim ? trim : erase) * 300;
+    }
+    else {  // (ERASE_GRP_SIZE + 1) * (ERASE_GRP_MULT + 1) write blocks
+        g->erase_unit = ((((g->csd[2] >> 10) & 0x1f) + 1)
+                * (((g->csd[2] >> 5) & 0x1f) + 1) << ((g->csd[3] >> 22) & 0xf))
+                / 512;
+        g->erase_ms = g->mmc_trim ? trim * 300 : 0;
+    }
+}
+
+/* eMMC: read EXT_CSD, switch to 8 bit bus (MMC_BUS_4BIT for 4 bit boards)
+ * and to HS52 timing when the device supports it */
+static SD_Error MMCEnWideBus(void)
+{
+    SD_Error ret = SD_OK;
+    u32_t ext_csd[128];
+    u8_t* ext = (u8_t*)ext_csd;
+    ret = SDReadData(CMD8, 0, ext_csd, 512);    // SEND_EXT_CSD
+    if(ret != SD_OK)
+        return (ret);
+    if(g->type == SDTYPE_HCMMC)
+        g->size = (ext[EXT_CSD_SEC_COUNT] | ext[EXT_CSD_SEC_COUNT + 1] << 8
+                | ext[EXT_CSD_SEC_COUNT + 2] << 16
+                | (u32_t)ext[EXT_CSD_SEC_COUNT + 3] << 24) / 2;
+    g->mmc_erased_ff = ext[EXT_CSD_ERASED_MEM_CONT] & 0x1;
+#ifdef MMC_BUS_4BIT
+    ret = MMCSwitch(EXT_CSD_BUS_WIDTH, 1);
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SetBusWidth(SDIO_BusWide_4b);
+#else
+    ret = MMCSwitch(EXT_CSD_BUS_WIDTH, 2);
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SetBusWidth(SDIO_BusWide_8b);
+#endif
+    if(ext[EXT_CSD_CARD_TYPE] & 0x2) {    // HS52
+        ret = MMCSwitch(EXT_CSD_HS_TIMING, 1);
+        if(ret != SD_OK)
+            return (ret);
+        g->sdio->CLKCR |= _BV(10);    // bypass the divider, SDIO_CK = 48MHz
+    }
+    MMCEraseGroups(ext_csd);
+    return (ret);
+}
+
+SD_Error SD_Init(void)
+{
+    SD_Error status = SD_OK;
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_SDIO, ENABLE);
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+    _dbg();
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;    // SD_TICKS()
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    SDWake();
+    pm.since = pm.last;
+    g->blklen = 0;
+    g->busy = false;    // nothing of a former session to wait for
+    g->erase_unit = g->erase_ms = g->erase_off = 0;
+    g->mmc_erased_ff = g->mmc_trim = false;
+    SDIO_DeInit();
+    _dbg();
+    status = SD_PowerON();
+    _dbg();
+    if(status != SD_OK)
+        return (status);    // 0
+    _dbg();
+    status = SD_InitializeCards();
+    _dbg();
+    if(status != SD_OK)
+        return (status);    // 1
+    _dbg();
+    SDIO_SetClockDiv(SDIO_TRANSFER_CLK_DIV);
+    _dbg();
+    SDIO_DMA_Config();
+    _dbg();
+    SDIO_SendCmdEx(CMD7, g->rca << 16, CMD_EX_DEFAULT);
+    if(SDTYPE_SDIO == g->type)
+        return SDIOInit();    // no CSD, SD Status or SCR
+    if(((g->csd[0] >> 30) == 0x0) || IS_MMC) {    // csd v1.0
+        u32_t c_size = ((g->csd[1] << 2) | (g->csd[2] >> 30)) & 0xfff;
+        g->size = (c_size + 1) * (1 << (((g->csd[2] >> 15) & 0x7) + 2    // abc
+                + ((g->csd[1] >> 16) & 0xf) - 10));    // abc
+    }
+    else if((g->csd[0] >> 30) == 0x1) {    // csd v2.0
+        g->size = ((g->csd[1] << 16 | g->csd[2] >> 16) & 0x3fffff) * 512;
+    }
+    _dbg();
+    int ret;
+    if(IS_MMC)
+        ret = MMCEnWideBus();
+    else
+        ret = SDEnWideBus();
+    _dbg();
+    if(SD_OK != ret)
+        return (ret);
+    _dbg();
+    if(!IS_MMC)
+        SDIO_SetBusWidth(SDIO_BusWide_4b);
+    _dbg();
+    SDIO_SendCmdEx(CMD16, 512, CMD_EX_DEFAULT);
+    _dbg();
+    ret = CmdResp1Error(CMD16);
+    _dbg();
+    if(SD_OK != ret)
+        return (ret);
+    if(IS_MMC)
+        return (status);    // no SD Status / SCR
+    static const u32_t au_lut[16] = {0, 16, 32, 64, 128, 256, 512, 1024,
+            2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536};
+    u32_t sd_status[16];
+    g->au = 0;
+    if(SD_ReadSDStatus(sd_status) == SD_OK) {   // AU_SIZE: bits 431:428
+        u8_t* st = (u8_t*)sd_status;
+        g->au = au_lut[st[10] >> 4];
+        g->erase_unit = g->au * 2;
+        /* ERASE_SIZE AUs in ERASE_TIMEOUT s, plus ERASE_OFFSET s */
+        if((st[11] | st[12]) && (st[13] >> 2))
+            g->erase_ms = (st[13] >> 2) * 1000 / (st[11] << 8 | st[12]);
+        g->erase_off = (st[13] & 0x3) * 1000;
+    }
+    g->scr[0] = g->scr[1] = 0;
+    SDIO_SendCmdEx(CMD55, g->rca << 16, CMD_EX_DEFAULT);
+    if(CmdResp1Error(CMD55) == SD_OK)
+        SDReadData(ACMD51, 0, g->scr, 8);    // SCR, failure leaves CMD23 off
+    g->cache = 0;
+    if(CMD48_SUPPORT)
+        SDReadPerfRegs();    // failure leaves the extensions off
+    if(g->io.nfunc)
+        status = SDIOInit();    // combo card
+    return (status);
+}
+
+/* Bind another card: its own controller and DMA, or the same ones behind
+ * a board bus switch that select() sets. The first call rebinds card 0. */
+SD_Card* SD_CardAttach(SDIO_TypeDef* sdio, DMA_Stream_TypeDef* dma, u32_t dma_tc,
+        void (*select)(void))
+{
+    SD_Card* card;
+    if(ncards == SD_MAX_CARDS)
+        return NULL;
+    card = &cards[ncards++];
+    card->sdio = sdio;
+    card->dma = dma;
+    card->dma_tc = dma_tc;
+    card->select = select;
+    return card;
+}
+
+/* Make card current for all other calls. Cards on one bus keep their own
+ * bus width and clock; a posted write may still be programming. */
+void SD_Select(SD_Card* card)
+{
+    if(card == g)
+        return;
+    SDWake();
+    g->clkcr = g->sdio->CLKCR;
+    g = card;
+    if(g->select)
+        g->select();
+    if(g->clkcr)
+        g->sdio->CLKCR = g->clkcr;
+    SDPwrSav();
+}
+
+SD_Card* SD_Selected(void)
+{
+    return g;
+}
+
+/* hook called between slices of writes longer than SD_WRITE_SLICE blocks,
+ * NULL writes in one piece; the hook may read, but must not write.
+ * Returns the hook it replaces. */
+void (*SD_SetWriteYield(void (*yield)(void)))(void)
+{
+    void (*was)(void) = g->yield;
+    g->yield = yield;
+    return (was);
+}
+
+/* progress(nbytes) is called while the DMA of a block read or write runs,
+ * with the bytes moved so far, last with the full length; NULL: off */
+void SD_SetDmaProgress(void (*progress)(u32_t nbytes))
+{
+    g->progress = progress;
+}
+
+void SD_SetIdlePolicy(u32_t policy, u32_t idle_ms)
+{
+    unsigned long long idle = (unsigned long long)idle_ms
+            * (SystemCoreClock / 1000);
+    SDWake();
+    pm.policy = policy;
+    /* SD_IdlePoll() measures on the 32 bit cycle counter */
+    pm.idle = (idle > 0x80000000UL) ? 0x80000000UL : (u32_t)idle;
+    SDPwrSav();
+}
+
+static void SDIdleAccount(void)
+{
+    u32_t now = DWT->CYCCNT;
+    if(pm.gated)
+        pm.st.idle += now - pm.since;
+    else
+        pm.st.active += now - pm.since;
+    pm.since = now;
+}
+
+/* A CLKCR write takes three SDIOCLK plus two PCLK2 periods to get
+ * through; the read back waits for the bus, the count for the rest
+ * (SDIOCLK 48 MHz or slower than HCLK, PCLK2 HCLK / 16 at the least) */
+static void SDClkcrSettle(void)
+{
+    u32_t t = DWT->CYCCNT;
+    (void)g->sdio->CLKCR;
+    while(DWT->CYCCNT - t < SystemCoreClock / 16000000 + 32)
+        ;
+}
+
+/* Stop SDIO_CK and the peripheral clock after the idle time. The card
+ * may stop its clock even while programming; an SDIO card in 4 bit mode
+ * needs it for interrupts, so those stay on. */
+void SD_IdlePoll(void)
+{
+    u32_t unused;
+    SDIdleAccount();
+    if(pm.gated || !(pm.policy & SD_IDLE_GATE)
+            || (pm.since - pm.last < pm.idle) || g->io.irq
+            || (g->sdio->STA & (SDIO_FLAG_CMDACT | SDIO_FLAG_TXACT
+                    | SDIO_FLAG_RXACT)))
+        return;
+    g->sdio->CLKCR &= ~_BV(8);
+    SDClkcrSettle();    // CLKEN clear before its clock stops
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_SDIO, DISABLE);
+    unused = pm.since - pm.last;    // clocked, but idle: move it over
+    if(unused > pm.st.active)
+        unused = pm.st.active;      // a reset came in between
+    pm.st.active -= unused;
+    pm.st.idle += unused;
+    pm.gated = true;
+    pm.st.gates++;
+}
+
+void SD_GetIdleStats(SD_IdleStats* st, bool reset)
+{
+    SDIdleAccount();
+    *st = pm.st;
+    if(reset)
+        pm.st.idle = pm.st.active = pm.st.gates = 0;
+}
+
+/* transfers of up to nbytes go through the FIFO by polling, not the DMA;
+ * 0: only those the DMA cannot reach */
+void SD_SetPioThreshold(u32_t nbytes)
+{
+    pio_max = nbytes;
+}
+
+/* Hardware flow control stops SDIO_CK while the FIFO is full or empty
+ * instead of overrunning it. STM32F1/F4 errata: the clock can glitch when
+ * it does, giving data CRC failures, which are then retried as well. */
+void SD_SetFlowControl(bool on)
+{
+    SDWake();
+    if(on)
+        g->sdio->CLKCR |= _BV(14);
+    else
+        g->sdio->CLKCR &= ~_BV(14);
+}
+
+void SD_GetSetupStats(SD_SetupStats* st, bool reset)
+{
+    *st = g->setup;
+    if(reset)
+        g->setup = (SD_SetupStats){0};
+}
+
+void SD_GetTimeoutStats(SD_TimeoutStats* st, bool reset)
+{
+    *st = g->tmo;
+    if(reset)
+        g->tmo = (SD_TimeoutStats){0};
+}
+#ifdef SD_FAULT_INJECT
+void SD_SetFaultHook(unsigned long (*hook)(unsigned char at, unsigned long sta))
+{
+    fault = hook;
+}
+#endif
+void SD_GetFifoStats(SD_FifoStats* st, bool reset)
+{
+    *st = g->fifo;
+    if(reset)
+        g->fifo = (SD_FifoStats){0};
+}
+
+/* posted writes return once the data is on the card, the programming
+ * wait moves to the next command or SD_CardBusy(); returns the previous
+ * setting, for layers that post only their own writes */
+bool SD_SetPostedWrites(bool on)
+{
+    bool was = g->posted;
+    g->posted = on;
+    return (was);
+}
+
+/* false once the last posted write is programmed, never blocks */
+SD_Error SD_CardBusy(bool* busy)
+{
+    SD_Error ret = SD_OK;
+    u8_t state = 0;
+    if(g->busy) {
+        ret = IsCardProgramming(&state);
+        if((ret != SD_OK) || ((state != SD_CARD_PROGRAMMING)
+                && (state != SD_CARD_RECEIVING)))
+            g->busy = false;
+    }
+    *busy = g->busy;
+    return (ret);
+}
+
+/* CMD16 only when the block length changes */
+static SD_Error SDSetBlockLen(u32_t nbytes)
+{
+    SD_Error ret = SD_OK;
+    if(g->blklen == nbytes)
+        return (ret);
+    SDIO_SendCmdEx(CMD16, nbytes, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(CMD16);
+    g->blklen = (ret == SD_OK) ? nbytes : 0;
+    return (ret);
+}
+
+static SD_Error SDReadBlock(u32_t addr, void* readbuff, int nbytes)
+{
+    SD_Error ret = SD_OK;
+    u8_t power = 0;
+    if(readbuff == NULL)
+        return SD_INVALID_PARAMETER;
+    if(g->cq.depth)
+        return SDQueueSync(false, addr, readbuff, 1);
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
+_dbg();
+    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
+            SDIO_DPSM_Disable);
+_dbg();
+    SDIO_DMACmdEx(DISABLE);
+_dbg();
+    if(SDIO_GetResponseEx(SDIO_RESP1) & SD_CARD_LOCKED)
+        return SD_LOCK_UNLOCK_FAILED;
+_dbg();
+    if(BLOCK_ADDRESSED)
+        nbytes = 512;
+_dbg();
+    if((nbytes > 0) && (nbytes <= 2048) && ((nbytes & (nbytes - 1)) == 0))
+        power = convert_from_bytes_to_power_of_two(nbytes);
+    else
+        return SD_INVALID_PARAMETER;
+_dbg();
+    SDIO_DataCfgEx(nbytes, (u32_t)power << 4, SDIO_TransferDir_ToSDIO,
+            SDIO_DPSM_Enable);
+_dbg();
+    SDDataStart(readbuff, nbytes, DMA_DIR_PeripheralToMemory);
+_dbg();
+    SDIO_SendCmdEx(CMD17, addr, CMD_EX_DEFAULT);
+_dbg();
+    ret = SDDataWait(nbytes);
+    if(ret == SD_OK)    // response checked once the data is in
+        ret = CmdResp1Error(CMD17);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+_dbg();
+    return (ret);
+}
+
+static SD_Error SDReadMultiBlocks(u32_t addr, void* readbuff, int nbytes, int nblocks)
+{
+    SD_Error ret = SD_OK;
+    u8_t power = 0;
+    if(NULL == readbuff)
+        return SD_INVALID_PARAMETER;
+    if(nblocks <= 1)    // CMD18 wants two blocks or more
+        return (nblocks == 1) ? SDReadBlock(addr, readbuff, nbytes)
+                : SD_INVALID_PARAMETER;
+    if(g->cq.depth)
+        return SDQueueSync(false, addr, readbuff, nblocks);
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
+            SDIO_DPSM_Disable);
+    SDIO_DMACmdEx(DISABLE);
+    if(SDIO_GetResponseEx(SDIO_RESP1) & SD_CARD_LOCKED)
+        return SD_LOCK_UNLOCK_FAILED;
+    if(BLOCK_ADDRESSED)
+        nbytes = 512;
+    if((nbytes > 0) && (nbytes <= 2048) && (0 == (nbytes & (nbytes - 1)))) {
+        power = convert_from_bytes_to_power_of_two(nbytes);
+        ret = SDSetBlockLen(nbytes);
+        if(SD_OK != ret)
+            return (ret);
+    }
+    else
+        return SD_INVALID_PARAMETER;
+    if(nblocks > 1) {
+        if(nblocks * nbytes > SD_MAX_DATA_LENGTH)
+            return SD_INVALID_PARAMETER;
+        if(CMD23_SUPPORT) {
+            SDIO_SendCmdEx(CMD23, nblocks, CMD_EX_DEFAULT);    // no CMD12 needed
+            ret = CmdResp1Error(CMD23);
+            if(ret != SD_OK)
+                return (ret);
+        }
+        SDIO_DataCfgEx(nbytes * nblocks, (u32_t)power << 4,
+                SDIO_TransferDir_ToSDIO, SDIO_DPSM_Enable);
+        SDIO_SendCmdEx(CMD18, addr, CMD_EX_DEFAULT);
+        ret = CmdResp1Error(CMD18);
+        if(ret != SD_OK)
+            return SDAbort(ret);
+        SDDataStart(readbuff, nbytes * nblocks, DMA_DIR_PeripheralToMemory);
+        ret = SDDataWait(nbytes * nblocks);
+        if(ret != SD_OK)
+            return SDAbort(ret);
+        if(CMD23_SUPPORT)
+            return (ret);
+        SDIO_SendCmdEx(CMD12, 0, CMD_EX_DEFAULT);    // stop transmission
+        ret = CmdResp1Error(CMD12);
+        if(ret != SD_OK)
+            return ret;
+    }
+    return (ret);
+}
+
+static SD_Error SDWriteBlock(unsigned long addr, void* writebuff, int nbytes)
+{
+    SD_Error ret = SD_OK;
+    u8_t power = 0;
+    if(writebuff == NULL)
+        return SD_INVALID_PARAMETER;
+    if(g->cq.depth)
+        return SDQueueSync(true, addr, writebuff, 1);
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
+            SDIO_DPSM_Disable);
+    SDIO_DMACmdEx(DISABLE);
+    if(SDIO_GetResponseEx(SDIO_RESP1) & SD_CARD_LOCKED)
+        return SD_LOCK_UNLOCK_FAILED;
+    if(BLOCK_ADDRESSED)
+        nbytes = 512;
     /* Set the block size, both on controller and card */
     if((nbytes > 0) && (nbytes <= 2048) && ((nbytes & (nbytes - 1)) == 0)) {
         power = convert_from_bytes_to_power_of_two(nbytes);
-        SDIO_SendCmdEx(CMD16, nbytes, CMD_EX_DEFAULT);
-        ret = CmdResp1Error(CMD16);
+        ret = SDSetBlockLen(nbytes);
         if(ret != SD_OK)
             return (ret);
     }
     else
         return SD_INVALID_PARAMETER;
-    /* Wait till card is ready for data Added */
-    timeout = SD_DATATIMEOUT;
-    do {
-        timeout--;
-        SDIO_SendCmdEx(CMD13, (u32_t)g.rca << 16, CMD_EX_DEFAULT);
-        ret = CmdResp1Error(CMD13);
-        if(ret != SD_OK)
-            return (ret);
-        cardstatus = SDIO_GetResponse(SDIO_RESP1);
-    } while(((cardstatus & 0x100) == 0) && (timeout > 0));
-    if(timeout == 0)
-        return (SD_ERROR);
     SDIO_SendCmdEx(CMD24, addr, CMD_EX_DEFAULT);
     ret = CmdResp1Error(CMD24);
     if(ret != SD_OK)
-        return (ret);
+        return SDAbort(ret);
 
     SDIO_DataCfgEx(nbytes, (u32_t)power << 4, SDIO_TransferDir_ToCard,
             SDIO_DPSM_Enable);
 
-    DMA_Cmd(DMA2_Stream3, DISABLE);
-    DMA2_Stream3->M0AR = (u32_t)writebuff;
-    DMA2_Stream3->NDTR = nbytes / 4;
-    DMA2_Stream3->CR = (DMA2_Stream3->CR & ~(3 << 6))
-            | DMA_DIR_MemoryToPeripheral;
-    SDIO_DMACmd(ENABLE);
-    DMA_Cmd(DMA2_Stream3, ENABLE);
-    if(SDIO->STA & SDIO_FLAG_DTIMEOUT)
-        return SD_DATA_TIMEOUT;
-    if(SDIO->STA & SDIO_FLAG_DCRCFAIL)
-        return SD_DATA_CRC_FAIL;
-    if(SDIO->STA & SDIO_FLAG_RXOVERR)
-        return SD_RX_OVERRUN;
-    ( {  while (DMA_GetFlagStatus(DMA2_Stream3, DMA_FLAG_TCIF3) == RESET);});
-    DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3);
-    //    SDIO_ClearFlag(SDIO_STATIC_FLAGS);
-    do {
-        ret = IsCardProgramming(&state);
-    } while((ret == SD_OK)
-            && ((state == SD_CARD_PROGRAMMING) || (state == SD_CARD_RECEIVING)));
-    return (ret);
+    SDDataStart(writebuff, nbytes, DMA_DIR_MemoryToPeripheral);
+    ret = SDDataWait(nbytes);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    g->busy = true;
+    if(g->posted)
+        return (ret);   // the next command waits for the programming
+    return SDWaitProgrammed();
 }
 
-SD_Error SD_WriteMultiBlocks(u32_t addr, void* writebuff, int nbytes, u32_t nblocks)
+static SD_Error SDWriteMultiBlocks(u32_t addr, void* writebuff, int nbytes, u32_t nblocks)
 {
     SD_Error ret = SD_OK;
-    u8_t power = 0, state = 0;
+    u8_t power = 0;
     if(writebuff == NULL)
         return SD_INVALID_PARAMETER;
+    if(nblocks <= 1)    // CMD25 wants two blocks or more
+        return (nblocks == 1) ? SDWriteBlock(addr, writebuff, nbytes)
+                : SD_INVALID_PARAMETER;
+    if(g->cq.depth)
+        return SDQueueSync(true, addr, writebuff, nblocks);
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
     SDIO_DataCfgEx(0, SDIO_DataBlockSize_1b, SDIO_TransferDir_ToCard,
             SDIO_DPSM_Disable);
-    SDIO_DMACmd(DISABLE);
-    if(SDIO_GetResponse(SDIO_RESP1) & SD_CARD_LOCKED)
+    SDIO_DMACmdEx(DISABLE);
+    if(SDIO_GetResponseEx(SDIO_RESP1) & SD_CARD_LOCKED)
         return SD_LOCK_UNLOCK_FAILED;
-    if(g.type == SDTYPE_SDHC) {
+    if(BLOCK_ADDRESSED)
         nbytes = 512;
-        addr /= 512;
-    }
     /* Set the block size, both on controller and card */
     if((nbytes > 0) && (nbytes <= 2048) && ((nbytes & (nbytes - 1)) == 0)) {
         power = convert_from_bytes_to_power_of_two(nbytes);
-        SDIO_SendCmdEx(CMD16, nbytes, CMD_EX_DEFAULT);
-        ret = CmdResp1Error(CMD16);
+        ret = SDSetBlockLen(nbytes);
         if(ret != SD_OK)
             return (ret);
     }
     else
         return SD_INVALID_PARAMETER;
-    /* Wait till card is ready for data Added */
-    int timeout = SD_DATATIMEOUT;
-    u32_t cardstatus = 0;
-    do {
-        timeout--;
-        SDIO_SendCmdEx(CMD13, (u32_t)g.rca << 16, CMD_EX_DEFAULT);
-        ret = CmdResp1Error(CMD13);
-        if(ret != SD_OK)
-            return (ret);
-        cardstatus = SDIO_GetResponse(SDIO_RESP1);
-    } while(((cardstatus & 0x100) == 0) && (timeout > 0));
-    if(timeout == 0)
-        return (SD_ERROR);
 
     if(nblocks > 1) {
         /* Common to all modes */
         if(nblocks * nbytes > SD_MAX_DATA_LENGTH)
             return SD_INVALID_PARAMETER;
-        if((SDTYPE_SDSC_V1_1 == g.type) || (SDTYPE_SDSC_V2_0 == g.type)
-                || (SDTYPE_SDHC == g.type)) {
-            SDIO_SendCmdEx(CMD55, (u32_t)(g.rca << 16), CMD_EX_DEFAULT);    // To improve performance
+        /* CMD23 gives the count and saves CMD12; only without it is the
+         * ACMD23 pre-erase hint sent, one or the other, not both */
+        if(!CMD23_SUPPORT && ((SDTYPE_SDSC_V1_1 == g->type)
+                || (SDTYPE_SDSC_V2_0 == g->type) || (SDTYPE_SDHC == g->type))) {
+            SDIO_SendCmdEx(CMD55, (u32_t)(g->rca << 16), CMD_EX_DEFAULT);    // To improve performance
             ret = CmdResp1Error(CMD55);
             if(ret != SD_OK)
                 return (ret);
@@ -810,6 +2149,12 @@ SD_Error SD_WriteMultiBlocks(u32_t addr, void* writebuff, int nbytes, u32_t nblo
             if(ret != SD_OK)
                 return (ret);
         }
+        if(CMD23_SUPPORT) {
+            SDIO_SendCmdEx(CMD23, nblocks, CMD_EX_DEFAULT);    // no CMD12 needed
+            ret = CmdResp1Error(CMD23);
+            if(ret != SD_OK)
+                return (ret);
+        }
         /* Send CMD25 WRITE_MULT_BLOCK with argument data address */
         SDIO_DataCfgEx(nbytes * nblocks, (u32_t)power << 4,
                 SDIO_TransferDir_ToCard, SDIO_DPSM_Enable);
@@ -817,27 +2162,284 @@ SD_Error SD_WriteMultiBlocks(u32_t addr, void* writebuff, int nbytes, u32_t nblo
         SDIO_SendCmdEx(CMD25, addr, CMD_EX_DEFAULT);
         ret = CmdResp1Error(CMD25);
         if(SD_OK != ret)
+            return SDAbort(ret);
+
+        SDDataStart(writebuff, nbytes * nblocks, DMA_DIR_MemoryToPeripheral);
+        ret = SDDataWait(nbytes * nblocks);
+        if(ret != SD_OK)
+            return SDAbort(ret);
+    }
+    if(!CMD23_SUPPORT) {
+        SDIO_SendCmdEx(CMD12, 0, CMD_EX_DEFAULT);    // stop transmission
+        ret = CmdResp1Error(CMD12);
+        if(ret != SD_OK)
+            return ret;
+    }
+    g->busy = true;
+    if(g->posted)
+        return (ret);   // the next command waits for the programming
+    return SDWaitProgrammed();
+}
+
+/* data path of a prepared transfer, DMA first */
+static void SDXferApply(const SD_Xfer* x, void* buff)
+{
+    SDDataStart(buff, x->dlen, x->dma_dir);
+    g->sdio->DTIMER = SD_DATATIMEOUT;
+    g->sdio->DLEN = x->dlen;
+    g->sdio->DCTRL = (g->sdio->DCTRL & DCTRL_CLEAR_MASK) | x->dctrl;
+}
+
+static SD_Error SDXferRun(const SD_Xfer* x, u32_t addr, void* buff)
+{
+    SD_Error ret = SD_OK;
+    bool multi = (x->nblocks > 1);
+    u8_t cmd = x->write ? (multi ? CMD25 : CMD24) : (multi ? CMD18 : CMD17);
+    if(g->cq.depth)
+        return SDQueueSync(x->write, addr, buff, x->nblocks);
+    ret = SDWaitProgrammed();
+    if(ret == SD_OK)
+        ret = SDSetBlockLen(512);
+    if(ret != SD_OK)
+        return (ret);
+    if(multi && CMD23_SUPPORT) {
+        SDIO_SendCmdEx(CMD23, x->nblocks, CMD_EX_DEFAULT);
+        ret = CmdResp1Error(CMD23);
+        if(ret != SD_OK)
+            return (ret);
+    }
+    if(!x->write)
+        SDXferApply(x, buff);
+    SDIO_SendCmdEx(cmd, addr, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(cmd);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    if(x->write)
+        SDXferApply(x, buff);
+    ret = SDDataWait(x->dlen);
+    if(ret != SD_OK)
+        return SDAbort(ret);
+    if(multi && !CMD23_SUPPORT) {
+        SDIO_SendCmdEx(CMD12, 0, CMD_EX_DEFAULT);    // stop transmission
+        ret = CmdResp1Error(CMD12);
+        if(ret != SD_OK)
             return (ret);
+    }
+    if(!x->write)
+        return (ret);
+    g->busy = true;
+    if(g->posted)
+        return (ret);
+    return SDWaitProgrammed();
+}
 
-        DMA_Cmd(DMA2_Stream3, DISABLE);
-        DMA2_Stream3->M0AR = (u32_t)writebuff;
-        DMA2_Stream3->NDTR = nbytes * nblocks / 4;
-        DMA2_Stream3->CR = (DMA2_Stream3->CR & ~(3 << 6))
-                | DMA_DIR_MemoryToPeripheral;
-        SDIO_DMACmd(ENABLE);
-        DMA_Cmd(DMA2_Stream3, ENABLE);
-        ( {  while (DMA_GetFlagStatus(DMA2_Stream3, DMA_FLAG_TCIF3) == RESET);});
-        DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3);
-    }
-//    SDIO_ClearFlag(SDIO_STATIC_FLAGS);
-    ( {  while ((SDIO->STA & SDIO_FLAG_DATAEND) == RESET);});
-    SDIO_SendCmdEx(CMD12, 0, CMD_EX_DEFAULT);    // stop transmission
-    ret = CmdResp1Error(CMD12);
-    if(ret != SD_OK)
-        return ret;
-    do {
-        ret = IsCardProgramming(&state);
-    } while((ret == SD_OK)
-            && ((state == SD_CARD_PROGRAMMING) || (state == SD_CARD_RECEIVING)));
+/* FIFO overrun or underrun, the bus lost to other AHB masters; with flow
+ * control on, its clock glitches show as CRC failures */
+static bool SDFifoError(SD_Error ret)
+{
+    return (ret == SD_RX_OVERRUN) || (ret == SD_TX_UNDERRUN)
+            || ((ret == SD_DATA_CRC_FAIL) && (g->sdio->CLKCR & _BV(14)));
+}
+
+/* halve SDIO_CK */
+static void SDSlowDown(void)
+{
+    u32_t clkcr = g->sdio->CLKCR;
+    if(clkcr & _BV(10))
+        g->sdio->CLKCR = clkcr & ~(_BV(10) | 0xff);
+    else if((clkcr & 0xff) < 0x7f)
+        SDIO_SetClockDiv((clkcr & 0xff) * 2 + 2);
+}
+
+/* Run a transfer again at half the clock after a FIFO error, up to
+ * SD_FIFO_RETRIES times, then return to the clock it started with; addr
+ * is the command argument, CARD_ADDR() or SECTOR_ADDR() */
+static SD_Error SDRetryRun(const SD_Xfer* x, bool write, u32_t addr,
+        void* buff, int nbytes, u32_t nblocks)
+{
+    SD_Error ret = SD_OK;
+    u32_t clk = g->sdio->CLKCR & (_BV(10) | 0xff), n;
+    g->t0 = DWT->CYCCNT | 1;
+    for(n = 0;; n++) {
+        if(x)
+            ret = SDXferRun(x, addr, buff);
+        else if(write)
+            ret = SDWriteMultiBlocks(addr, buff, nbytes, nblocks);
+        else
+            ret = SDReadMultiBlocks(addr, buff, nbytes, nblocks);
+        if(!SDFifoError(ret) || (n == SD_FIFO_RETRIES))
+            break;
+        g->fifo.retries++;
+        SDSlowDown();
+    }
+    g->t0 = 0;
+    if(n) {
+        g->sdio->CLKCR = (g->sdio->CLKCR & ~(_BV(10) | 0xff)) | clk;
+        if(ret != SD_OK)
+            g->fifo.failed++;
+    }
+    return (ret);
+}
+
+/* SDRetryRun(), a long write in slices while a write yield hook is set:
+ * stop (CMD12) every SD_WRITE_SLICE blocks and let the hook serve urgent
+ * requests before the rest is resumed. A FIFO error retries its slice. */
+static SD_Error SDRetry(const SD_Xfer* x, bool write, u32_t addr, void* buff,
+        int nbytes, u32_t nblocks)
+{
+    SD_Error ret = SD_OK;
+    void (*yield)(void) = g->yield;
+    u32_t n, left = nblocks, at = addr, step = BLOCK_ADDRESSED ? 512 : nbytes;
+    u8_t* p = buff;
+#ifdef SD_TRACE
+    u32_t start = DWT->CYCCNT;
+#endif
+    if(!write || !yield || (nblocks <= SD_WRITE_SLICE))
+        ret = SDRetryRun(x, write, addr, buff, nbytes, nblocks);
+    else {
+        g->yield = NULL;    // the hook may read, but must not write
+        while(left && (ret == SD_OK)) {
+            n = (left > SD_WRITE_SLICE) ? SD_WRITE_SLICE : left;
+            ret = SDRetryRun(NULL, true, at, p, nbytes, n);
+            at += BLOCK_ADDRESSED ? n : n * step;
+            p += n * step;
+            left -= n;
+            if(left && (ret == SD_OK))
+                yield();
+        }
+        g->yield = yield;
+    }
+#ifdef SD_TRACE
+    if(!g->cq.depth)    // SD_QueueRun() traces those
+        SD_TraceAdd(write ? SD_TRACE_WRITE : SD_TRACE_READ,
+                BLOCK_ADDRESSED ? addr : addr / 512,
+                BLOCK_ADDRESSED ? nblocks : nblocks * nbytes / 512,
+                start, ret, g - cards);
+#endif
+    return (ret);
+}
+
+SD_Error SD_ReadBlock(u32_t addr, void* readbuff, int nbytes)
+{
+    return SDRetry(NULL, false, CARD_ADDR(addr), readbuff, nbytes, 1);
+}
+
+SD_Error SD_ReadMultiBlocks(u32_t addr, void* readbuff, int nbytes, int nblocks)
+{
+    return SDRetry(NULL, false, CARD_ADDR(addr), readbuff, nbytes, nblocks);
+}
+
+SD_Error SD_WriteBlock(unsigned long addr, void* writebuff, int nbytes)
+{
+    return SDRetry(NULL, true, CARD_ADDR(addr), writebuff, nbytes, 1);
+}
+
+SD_Error SD_WriteMultiBlocks(u32_t addr, void* writebuff, int nbytes,
+        u32_t nblocks)
+{
+    return SDRetry(NULL, true, CARD_ADDR(addr), writebuff, nbytes, nblocks);
+}
+
+SD_Error SD_ReadSectors(u32_t lba, void* buff, u32_t n)
+{
+    return SDRetry(NULL, false, SECTOR_ADDR(lba), buff, 512, n);
+}
+
+SD_Error SD_WriteSectors(u32_t lba, const void* buff, u32_t n)
+{
+    return SDRetry(NULL, true, SECTOR_ADDR(lba), (void*)buff, 512, n);
+}
+
+SD_Error SD_XferPrep(SD_Xfer* x, bool write, u32_t nblocks)
+{
+    if((x == NULL) || (nblocks == 0) || (nblocks > SD_MAX_DATA_LENGTH / 512))
+        return SD_INVALID_PARAMETER;
+    *x = (SD_Xfer)SD_XFER(write, nblocks);
+    return SD_OK;
+}
+
+SD_Error SD_XferRun(const SD_Xfer* x, u32_t lba, void* buff)
+{
+    if((x == NULL) || (buff == NULL))
+        return SD_INVALID_PARAMETER;
+    return SDRetry(x, x->write, SECTOR_ADDR(lba), buff, 512, x->nblocks);
+}
+
+/* Bound for erasing the sectors first to last: per AU (SD) or erase group
+ * (MMC) from the SD status, TRIM_MULT or ERASE_TIMEOUT_MULT, else 250 ms
+ * per 4 MiB or group as SD
+ * cards without ERASE_TIMEOUT must meet */
+static u32_t SDEraseTimeout(u32_t first, u32_t last)
+{
+    u32_t unit = g->erase_unit ? g->erase_unit : 8192;
+    unsigned long long ms = (g->erase_ms ? g->erase_ms : 250);
+    ms = ms * (last / unit - first / unit + 1) + g->erase_off;
+    if(ms < SD_BUSY_TIMEOUT_MS)
+        return SD_BUSY_TIMEOUT_MS;
+    return (ms > 0xffffffffUL) ? 0xffffffffUL : (u32_t)ms;
+}
+
+/* Erase the blocks from start to end, command arguments of the first and
+ * the last block; they then read as SD_ErasedByte(). MMC uses TRIM where
+ * it has it; a plain erase takes whole erase groups, so a range that is
+ * not made of them is SD_REQUEST_NOT_APPLICABLE there. */
+static SD_Error SDErase(u32_t start, u32_t end)
+{
+    SD_Error ret = SD_OK;
+    if((end < start) || (((g->csd[1] >> 20) & SD_CCCC_ERASE) == 0))
+        return SD_REQUEST_NOT_APPLICABLE;
+    ret = SDWaitProgrammed();
+    if(ret != SD_OK)
+        return (ret);
+    if(IS_MMC && !g->mmc_trim) {
+        u32_t unit = BLOCK_ADDRESSED ? g->erase_unit : g->erase_unit * 512;
+        if(!unit || (start % unit)
+                || ((end + (BLOCK_ADDRESSED ? 1 : 512)) % unit))
+            return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if(SDIO_GetResponseEx(SDIO_RESP1) & SD_CARD_LOCKED)
+        return SD_LOCK_UNLOCK_FAILED;
+    SDIO_SendCmdEx(IS_MMC ? CMD35 : CMD32, start, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(IS_MMC ? CMD35 : CMD32);
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SendCmdEx(IS_MMC ? CMD36 : CMD33, end, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(IS_MMC ? CMD36 : CMD33);
+    if(ret != SD_OK)
+        return (ret);
+    SDIO_SendCmdEx(CMD38, (IS_MMC && g->mmc_trim) ? 1 : 0, CMD_EX_DEFAULT);
+    ret = CmdResp1Error(CMD38);
+    if(ret != SD_OK)
+        return (ret);
+    g->busy = true;  // busy until the erase is done, can take seconds
+    g->busy_ms = BLOCK_ADDRESSED ? SDEraseTimeout(start, end)
+            : SDEraseTimeout(start / 512, end / 512);
+    if(g->posted)
+        return (ret);
+    return SDWaitProgrammed();
+}
+
+SD_Error SD_Erase(u32_t startaddr, u32_t endaddr)
+{
+    return SD_EraseSectors(startaddr / 512, endaddr / 512);
+}
+
+SD_Error SD_EraseSectors(u32_t first, u32_t last)
+{
+#ifdef SD_TRACE
+    u32_t start = DWT->CYCCNT;
+    SD_Error ret = SDErase(SECTOR_ADDR(first), SECTOR_ADDR(last));
+    SD_TraceAdd(SD_TRACE_ERASE, first, last - first + 1, start, ret, g - cards);
     return (ret);
+#else
+    return SDErase(SECTOR_ADDR(first), SECTOR_ADDR(last));
+#endif
+}
+
+/* content of erased blocks, SCR DATA_STAT_AFTER_ERASE */
+u8_t SD_ErasedByte(void)
+{
+    if(IS_MMC)
+        return g->mmc_erased_ff ? 0xff : 0x00;
+    return (((u8_t*)g->scr)[1] & 0x80) ? 0xff : 0x00;
 }
@@ -1,6 +1,8 @@
 #ifndef _SDIO_F4_H
 #define _SDIO_F4_H
 
+#include <stdbool.h>
+
 typedef enum {
     /* SDIO specific error defines */
     SD_CMD_CRC_FAIL = (1), /* Command response received (but CRC check failed) */
@@ -50,12 +52,149 @@ typedef enum {
 
 void SD_ReadInfo(void);
 void SD_GetSize(void);
+/* Cards are driven one at a time through the selected context, card 0
+ * (SDIO, DMA2_Stream3) by default. The selection is global and no call
+ * takes a card: an interrupt handler and a task cannot each drive a card,
+ * the caller serializes all calls and selects before them. */
+typedef struct SD_Card SD_Card;
+SD_Card* SD_CardAttach(SDIO_TypeDef* sdio, DMA_Stream_TypeDef* dma, unsigned long dma_tc,
+        void (*select)(void));
+void SD_Select(SD_Card* card);
+SD_Card* SD_Selected(void);
+
 SD_Error SD_Init(void);
+/* Byte addressed transfers, below 4 GiB only; nbytes is the block length,
+ * always 512 on block addressed cards (SDHC/SDXC, high capacity MMC) */
 SD_Error SD_ReadBlock(unsigned long addr, void* readbuff, int nbytes);
 SD_Error SD_ReadMultiBlocks(unsigned long addr, void* readbuff, int nbytes,
         int nblocks);
 SD_Error SD_WriteBlock(unsigned long addr, void* writebuff, int nbytes);
 SD_Error SD_WriteMultiBlocks(unsigned long addr, void* writebuff, int nbytes,
         unsigned long nblocks);
+SD_Error SD_Erase(unsigned long startaddr, unsigned long endaddr);
+/* 512 byte sector addressed, the whole card */
+SD_Error SD_ReadSectors(unsigned long lba, void* buff, unsigned long n);
+SD_Error SD_WriteSectors(unsigned long lba, const void* buff, unsigned long n);
+SD_Error SD_EraseSectors(unsigned long first, unsigned long last);
+unsigned char SD_ErasedByte(void);
+/* returns the write yield hook it replaces */
+void (*SD_SetWriteYield(void (*yield)(void)))(void);
+bool SD_SetPostedWrites(bool on);
+void SD_SetDmaProgress(void (*progress)(unsigned long nbytes));
+SD_Error SD_CardBusy(bool* busy);
+/* Errors are watched all through the data phase; a transfer that hits a
+ * FIFO overrun or underrun is run again at half the clock */
+typedef struct {
+    unsigned long overruns, underruns, crc; // data path errors seen
+    unsigned long retries, failed;  // runs at a lower clock, still failing
+} SD_FifoStats;
+void SD_SetFlowControl(bool on);
+void SD_SetPioThreshold(unsigned long nbytes);
+
+/* Prepared transfer of nblocks 512 byte sectors: the data path and DMA
+ * register images for one size and direction, built once and applied
+ * with a few stores. SD_XFER() builds one at compile time (nblocks up to
+ * 65535, unchecked), SD_XferPrep() at run time. */
+typedef struct {
+    unsigned long dctrl, dlen, dma_dir, nblocks;
+    bool write;
+} SD_Xfer;
+#define SD_XFER(wr, n)  {SDIO_DataBlockSize_512b | SDIO_DPSM_Enable \
+        | ((wr) ? SDIO_TransferDir_ToCard : SDIO_TransferDir_ToSDIO), \
+        (n) * 512, (wr) ? DMA_DIR_MemoryToPeripheral : DMA_DIR_PeripheralToMemory, (n), (wr)}
+SD_Error SD_XferPrep(SD_Xfer* x, bool write, unsigned long nblocks);
+SD_Error SD_XferRun(const SD_Xfer* x, unsigned long lba, void* buff);
+/* ticks from the call to the data command going out */
+typedef struct {
+    unsigned long count, sum, max;
+} SD_SetupStats;
+void SD_GetSetupStats(SD_SetupStats* st, bool reset);
+void SD_GetFifoStats(SD_FifoStats* st, bool reset);
+/* Every wait on the controller and the card is bounded: a command
+ * response by SD_CMD_TIMEOUT_MS, a data phase by SD_DATA_TIMEOUT_MS
+ * without moving a word, so long transfers get it for every block, and
+ * programming after a write by SD_BUSY_TIMEOUT_MS, an erase by the time
+ * the card gives for it (SD status, EXT_CSD TRIM_MULT). The call then
+ * fails with SD_CMD_RSP_TIMEOUT or SD_DATA_TIMEOUT, a data transfer is
+ * aborted first and a card still programming is waited for again by the
+ * next. */
+typedef struct {
+    unsigned long cmd, data, busy;  // waits that ran out
+} SD_TimeoutStats;
+void SD_GetTimeoutStats(SD_TimeoutStats* st, bool reset);
+#ifdef SD_FAULT_INJECT
+/* Test hook, gets the status flags where the driver checks them, after a
+ * command response (SD_FAULT_AT_CMD) and in the data phase
+ * (SD_FAULT_AT_DATA), and the flags it returns are acted on instead. At
+ * SD_FAULT_AT_BUSY (sta 0) a non zero return makes the card look like it
+ * is still programming. NULL removes it. */
+enum {
+    SD_FAULT_AT_CMD,
+    SD_FAULT_AT_DATA,
+    SD_FAULT_AT_BUSY
+};
+void SD_SetFaultHook(unsigned long (*hook)(unsigned char at, unsigned long sta));
+#endif
+SD_Error SD_ReadSDStatus(void* buff);
+unsigned long SD_GetAUSize(void);
+unsigned long SD_GetCardSize(void);
+
+/* Idle power policy, SD_IDLE_* bits. PWRSAV has the controller stop
+ * SDIO_CK whenever the bus is idle, except while an SDIO interrupt
+ * handler is set. GATE also stops SDIO_CK and the
+ * peripheral clock once the bus was unused for idle_ms, checked by
+ * SD_IdlePoll(), which must run in the context doing the transfers (idle
+ * loop, not an interrupt) and, for the statistics, at least every few
+ * seconds. The next call wakes the controller with a few register writes,
+ * the card stays selected. The stats count the time from the last use
+ * to a gate as idle once it gates, as active until then. idle_ms is
+ * capped at half the cycle counter period, about 12 s at 168 MHz. Times are
+ * in SD_TICKS(). */
+enum {
+    SD_IDLE_PWRSAV = 0x1,
+    SD_IDLE_GATE = 0x2,
+};
+typedef struct {
+    unsigned long idle, active;     // ticks unused or gated, in use
+    unsigned long gates;
+} SD_IdleStats;
+void SD_SetIdlePolicy(unsigned long policy, unsigned long idle_ms);
+void SD_IdlePoll(void);
+void SD_GetIdleStats(SD_IdleStats* st, bool reset);
+
+/* SD_GetPerfCaps() bits, from the SD 6.0 performance enhancement register */
+enum {
+    SD_PERF_FX_EVENT = 0x1,
+    SD_PERF_HOST_MAINT = 0x2,
+    SD_PERF_CARD_MAINT = 0x4,
+    SD_PERF_CACHE = 0x8,
+    SD_PERF_CQ = 0x10,
+};
+unsigned long SD_GetPerfCaps(void);
+SD_Error SD_CacheCtrl(bool enable);
+SD_Error SD_Flush(void);
+
+/* Command queue mode (SD_PERF_CQ). Once enabled, the per-request API runs
+ * through the queue. Submit returns SD_REQUEST_PENDING when all depth
+ * slots are taken; SD_QueueRun() moves the data of one ready task. */
+SD_Error SD_QueueEnable(unsigned long depth);
+SD_Error SD_QueueSubmit(bool write, unsigned long lba, void* buff,
+        unsigned long nblocks, unsigned char* ptag);
+SD_Error SD_QueueRun(void);
+SD_Error SD_QueueStatus(unsigned char tag);
+
+/* SDIO I/O functions; addresses are the 17 bit register address */
+SD_Error SD_IORead8(unsigned char func, unsigned long addr, unsigned char* data);
+SD_Error SD_IOWrite8(unsigned char func, unsigned long addr, unsigned char data);
+SD_Error SD_IORead(unsigned char func, unsigned long addr, void* buff,
+        unsigned long nbytes, bool incr);
+SD_Error SD_IOWrite(unsigned char func, unsigned long addr, const void* buff,
+        unsigned long nbytes, bool incr);
+SD_Error SD_IOEnableFunc(unsigned char func);
+SD_Error SD_IOIrqEnable(unsigned char func, void (*handler)(void));
+void SD_IOIrqHandler(void);
+/* NULL for what is not needed */
+void SD_IOGetInfo(unsigned char* nfunc, unsigned short* manf,
+        unsigned short* card);
 
 #endif
@@ -0,0 +1,226 @@
+/* Host side replay of an SD_TraceDump() capture.
+ *
+ *   cc -O2 -o sd_replay tools/sd_replay.c
+ *   sd_replay [options] trace.bin
+ *
+ * Requests run in trace order against a card model (default) or, with -i,
+ * against an image file through pread/pwrite. The report puts the recorded
+ * figures next to the replayed ones. Change sim() or add a layer in
+ * replay() to try caching or scheduling on the recorded workload. SDIO
+ * records are left out, they are not sectors.
+ *
+ *   -i image   file backed card, wall clock latencies
+ *   -t         keep the recorded request times (open loop), else back to back
+ *   -c us      model: command overhead per request (100)
+ *   -r MB/s    model: read bandwidth (20)
+ *   -w MB/s    model: write bandwidth (10)
+ *   -p us      model: programming time of a write not following the last (2000)
+ *   -e us      model: erase time (5000) */
+#define _XOPEN_SOURCE 700
+#include "../sd_trace.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    unsigned long n, sectors, errors;
+    double sum, max;    // latency, us
+    double* lat;
+} OpStats;
+
+static struct {
+    double cmd_us, rd_mbs, wr_mbs, prog_us, erase_us;
+    int fd;
+    unsigned long next_wr;  // sector after the last write, for the model
+} cfg = {100, 20, 10, 2000, 5000, -1, ~0UL};
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: sd_replay [-i image] [-t] [-c us] [-r MB/s] "
+            "[-w MB/s] [-p us] [-e us] trace.bin\n");
+    exit(2);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* card model: service time of one request in us */
+static double sim(const SD_TraceRec* r)
+{
+    double us = cfg.cmd_us, bytes = r->count * 512.0;
+    switch(r->op) {
+    case SD_TRACE_READ:
+        us += bytes / cfg.rd_mbs;
+        break;
+    case SD_TRACE_WRITE:
+        us += bytes / cfg.wr_mbs;
+        if(r->lba != cfg.next_wr)
+            us += cfg.prog_us;
+        cfg.next_wr = r->lba + r->count;
+        break;
+    case SD_TRACE_ERASE:
+        us += cfg.erase_us;
+        break;
+    }
+    return us;
+}
+
+/* image backed: the real I/O, wall clock */
+static double io(const SD_TraceRec* r)
+{
+    static unsigned char* buf;
+    static size_t size;
+    size_t len = (size_t)r->count * 512;
+    off_t off = (off_t)r->lba * 512;
+    double t0 = now_us();
+    ssize_t done = 0;
+    if(len > size) {
+        buf = realloc(buf, len);
+        if(buf == NULL) {
+            perror("sd_replay");
+            exit(1);
+        }
+        size = len;
+    }
+    if(r->op == SD_TRACE_READ)
+        done = pread(cfg.fd, buf, len, off);
+    else {
+        /* content does not matter to the timing, keep it reproducible */
+        for(size_t i = 0; i < len; i += 4)
+            *(uint32_t*)(buf + i) = r->lba + i / 512;
+        if(r->op == SD_TRACE_ERASE)
+            memset(buf, 0xff, len);
+        done = pwrite(cfg.fd, buf, len, off);
+    }
+    if(done < 0)
+        perror("sd_replay");
+    return now_us() - t0;
+}
+
+static void add(OpStats* s, double us, unsigned long sectors, int err)
+{
+    s->lat[s->n++] = us;
+    s->sectors += sectors;
+    s->sum += us;
+    if(us > s->max)
+        s->max = us;
+    s->errors += err;
+}
+
+static int cmp(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* name, OpStats* s, double span_us)
+{
+    if(s->n == 0)
+        return;
+    qsort(s->lat, s->n, sizeof(double), cmp);
+    printf("  %-6s %8lu req %10lu sect %8.2f MB/s  lat us avg %8.1f "
+            "p50 %8.1f p99 %8.1f max %8.1f", name, s->n, s->sectors,
+            span_us > 0 ? s->sectors * 512.0 / span_us : 0, s->sum / s->n,
+            s->lat[s->n / 2], s->lat[s->n * 99 / 100], s->max);
+    if(s->errors)
+        printf("  errors %lu", s->errors);
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* image = NULL;
+    int opt, timed = 0;
+    FILE* f;
+    SD_TraceHdr h;
+    SD_TraceRec* rec;
+    OpStats rec_st[4] = {{0}}, rep_st[4] = {{0}};
+    static const char* names[4] = {"", "read", "write", "erase"};
+    double tpus, t, at, busy = 0, span_rec;
+    unsigned long long ticks = 0;
+    while((opt = getopt(argc, argv, "i:tc:r:w:p:e:")) != -1) {
+        switch(opt) {
+        case 'i': image = optarg; break;
+        case 't': timed = 1; break;
+        case 'c': cfg.cmd_us = atof(optarg); break;
+        case 'r': cfg.rd_mbs = atof(optarg); break;
+        case 'w': cfg.wr_mbs = atof(optarg); break;
+        case 'p': cfg.prog_us = atof(optarg); break;
+        case 'e': cfg.erase_us = atof(optarg); break;
+        default: usage();
+        }
+    }
+    if(optind + 1 != argc)
+        usage();
+    f = fopen(argv[optind], "rb");
+    if((f == NULL) || (fread(&h, sizeof(h), 1, f) != 1)
+            || (h.magic != SD_TRACE_MAGIC) || (h.ticks_per_ms == 0)) {
+        fprintf(stderr, "sd_replay: %s: not a trace\n", argv[optind]);
+        return 1;
+    }
+    rec = calloc(h.count ? h.count : 1, sizeof(*rec));
+    for(int i = 1; i < 4; i++) {
+        rec_st[i].lat = calloc(h.count + 1, sizeof(double));
+        rep_st[i].lat = calloc(h.count + 1, sizeof(double));
+    }
+    if(fread(rec, sizeof(*rec), h.count, f) != h.count) {
+        fprintf(stderr, "sd_replay: %s: truncated\n", argv[optind]);
+        return 1;
+    }
+    fclose(f);
+    if(image) {
+        cfg.fd = open(image, O_RDWR | O_CREAT, 0644);
+        if(cfg.fd < 0) {
+            perror(image);
+            return 1;
+        }
+    }
+    tpus = h.ticks_per_ms / 1000.0;
+    /* recorded: unwrap the 32 bit tick stamps */
+    for(uint32_t i = 0; i < h.count; i++) {
+        if(i)
+            ticks += (uint32_t)(rec[i].time - rec[i - 1].time);
+        if((rec[i].op < 1) || (rec[i].op > 3))
+            continue;
+        add(&rec_st[rec[i].op], rec[i].latency / tpus, rec[i].count,
+                rec[i].result != 0);
+    }
+    span_rec = h.count ? (ticks + rec[h.count - 1].latency) / tpus : 0;
+    /* replay */
+    t = 0;
+    ticks = 0;
+    for(uint32_t i = 0; i < h.count; i++) {
+        double us;
+        if(i)
+            ticks += (uint32_t)(rec[i].time - rec[i - 1].time);
+        if((rec[i].op < 1) || (rec[i].op > 3))
+            continue;
+        at = timed ? ticks / tpus : t;
+        if(at < t)
+            at = t;     // the card is still busy with the last one
+        us = image ? io(&rec[i]) : sim(&rec[i]);
+        busy += us;
+        t = at + us;
+        add(&rep_st[rec[i].op], t - (timed ? ticks / tpus : at), rec[i].count, 0);
+    }
+    if(image)
+        close(cfg.fd);
+    printf("%u requests, %u lost before the capture, %.1f ms recorded\n",
+            h.count, h.lost, span_rec / 1000);
+    printf("recorded:\n");
+    for(int i = 1; i < 4; i++)
+        report(names[i], &rec_st[i], span_rec);
+    printf("replayed (%s, %s): %.1f ms, card busy %.0f%%\n",
+            image ? image : "model", timed ? "recorded times" : "back to back",
+            t / 1000, t > 0 ? 100 * busy / t : 0);
+    for(int i = 1; i < 4; i++)
+        report(names[i], &rep_st[i], t);
+    return 0;
+}
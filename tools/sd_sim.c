@@ -0,0 +1,938 @@
+/* Host harness: the F1 driver and its fault injection stress run against a
+ * model of the SDIO controller, its DMA channel and an SDHC card, or the
+ * RAID-0 layer against two such cards on the one controller.
+ *
+ *   cc -O2 -DSTM32F10X_HD -DSD_FAULT_INJECT -Itools/sim -o sd_sim \
+ *       tools/sd_sim.c sdio_f1.c sd_stress.c sd_raid0.c sd_sched.c
+ *   sd_sim [options]
+ *
+ * tools/sim/misc.h stands in for the SPL. The model runs in the driver's
+ * thread: every DWT->CYCCNT read moves time on by a few cycles and lets
+ * data move and the card finish programming at the times the bus clock
+ * and the card give. Commands are answered at once, their bus time added
+ * to the clock, as CmdError() and CmdResp7Error() count loops, not ticks.
+ * The card follows the SD state machine: a command that is illegal in the
+ * current state gets no response and sets ILLEGAL_COMMAND in the next R1,
+ * CMD55 arms only the command right after it, CMD12 ends data and rcv
+ * states. Transfers go by DMA only, SDPioMove() moves u32_t words, which
+ * are 64 bit here. Prints the stress report, exits non zero when the run
+ * saw failed clean requests or corruption.
+ *
+ * With -c, another AHB master (an LCD refresh) takes the bus for up to the
+ * given time, every 50 us on average, while data moves. A stall longer
+ * than the 32 word FIFO lasts at the current SDIO_CK overruns a read or
+ * underruns a write; with flow control (-w) the clock stops instead and,
+ * as the errata have it, glitches one time in eight, a data CRC failure
+ * at the end of the block. -f 0 -c 15 checks that FIFO recovery keeps
+ * the top clock: the report has the clock the run ended on.
+ *
+ * With -r, a second card sits on the bus behind a board switch (the
+ * SD_CardAttach() select callback) and no faults are injected: the same
+ * writes go to one card and then striped over both, and both are read
+ * back and checked. A card not selected goes on programming, which is
+ * the time RAID-0 wins back on writes; a longer -p shows it better. Reads
+ * gain nothing: the one bus carries the data of either card.
+ *
+ *   -s seed    stress seed (1)
+ *   -n count   requests (2000)
+ *   -f rate    faults per 1000 requests, of every class (20)
+ *   -b ms      length of an injected busy period (50)
+ *   -a us      card read access time (100)
+ *   -p us      card programming time after a write (250)
+ *   -2         card without CMD23 (SCR CMD_SUPPORT clear), so multiple
+ *              block reads end with CMD12, which the card answers only
+ *              after the access time of the block it has fetched ahead
+ *   -c us      bus contention, longest stall (0: none)
+ *   -w         hardware flow control on
+ *   -r kb      RAID-0 run over two cards, kbytes written (0: stress run)
+ *   -l kb      read latency under a bulk write of kbytes (0: stress run)
+ *   -x count   setup time of count 8 sector writes and reads, prepared
+ *              (SD_XferRun) and classic (0: stress run)
+ *
+ * With -l, one write of the given size goes through the scheduler
+ * (sd_sched.c) while 8 sector reads elsewhere on the card arrive every
+ * millisecond, submitted as from an interrupt whenever PRIMASK is clear.
+ * It runs twice: written in one piece with the reads served after it,
+ * and with the scheduler's write yield hook, which stops the write every
+ * SD_WRITE_SLICE blocks and serves the reads waiting. The report has the
+ * time the reads waited in the queue and the time of the write. */
+#include "misc.h"
+#include "../sd_stress.h"
+#include "../sd_raid0.h"
+#include "../sd_sched.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CARD_SECTORS    65536UL     // 32 MiB
+#define CARD_RCA        0x1234UL
+#define TICKS_PER_READ  4           // cycles a DWT read stands for
+
+SDIO_TypeDef sdio_regs;
+CRC_TypeDef crc_regs;
+CoreDebug_Type cd_regs;
+DMA_Channel_TypeDef dma2c4;
+uint32_t SystemCoreClock = 72000000;
+uint32_t sim_primask;
+static DWT_Type dwt;
+
+enum {
+    ST_IDLE, ST_READY, ST_IDENT, ST_STBY, ST_TRAN, ST_DATA, ST_RCV, ST_PRG
+};
+enum {
+    R1_OUT_OF_RANGE = 0x80000000, R1_BLOCK_LEN_ERROR = 0x20000000,
+    R1_ILLEGAL_COMMAND = 0x400000, R1_READY_FOR_DATA = 0x100,
+    R1_APP_CMD = 0x20
+};
+
+static struct {
+    unsigned long access, prog, erase, stall;   // ticks
+    bool cmd23;
+} cfg = {100, 250, 2000, 0, true};
+
+/* the cards, commands go to the selected one */
+static struct card {
+    uint8_t* mem;
+    int state;
+    bool app, ready;        // CMD55 just seen, ACMD41 done
+    uint32_t err;           // R1 error bits for the next response
+    uint32_t count;         // CMD23 blocks for the next data command
+    uint32_t addr, left;    // next sector, blocks to go (0: until CMD12)
+    uint32_t got;           // blocks of the write received
+    uint32_t erase_first, erase_last;
+    const uint8_t* reg;     // register data instead of sectors
+    uint32_t reglen;
+    uint8_t sd_status[64], scr[8];
+    unsigned long start, until; // data from, data or busy until
+} cards[2], *card = &cards[0];
+
+/* the controller data path and DMA */
+static struct {
+    bool armed, moving, read, tc;
+    uint32_t dlen;
+    unsigned long start, end;
+    uint32_t fail;          // error flag the transfer stops with at fail_at
+    unsigned long fail_at;
+} dp;
+
+/* reads arriving during the -l write */
+#define LAT_READS   4096
+static struct {
+    bool on, in;
+    unsigned long next, every;  // next arrival, ticks between
+    uint32_t n;
+    SD_Req req[LAT_READS];
+} lat;
+
+/* bus contention while data moves */
+static struct {
+    bool on;
+    uint32_t rand;
+    unsigned long stalls, errors;   // longer than the FIFO lasts, failed
+} bus;
+
+static unsigned long Now(void)
+{
+    return dwt.CYCCNT;
+}
+
+/* SDIO_CK periods in CPU cycles, and cycles per byte on the bus */
+static unsigned long ClockTicks(void)
+{
+    uint32_t clkcr = sdio_regs.CLKCR;
+    return (clkcr & _BV(10)) ? 1 : (clkcr & 0xff) + 2;
+}
+
+static unsigned long ByteTicks(void)
+{
+    uint32_t width = (sdio_regs.CLKCR & SDIO_BusWide_8b) ? 8
+            : (sdio_regs.CLKCR & SDIO_BusWide_4b) ? 4 : 1;
+    return ClockTicks() * 8 / width;
+}
+
+static uint32_t Rand(void)
+{
+    bus.rand ^= bus.rand << 13;
+    bus.rand ^= bus.rand >> 17;
+    bus.rand ^= bus.rand << 5;
+    return bus.rand;
+}
+
+/* stalls of the DMA over the transfer just started, the first one the
+ * FIFO does not ride out ends it */
+static void Contention(void)
+{
+    unsigned long every = 50 * (SystemCoreClock / 1000000);
+    unsigned long fifo = 32 * 4 * ByteTicks(), block = 512 * ByteTicks();
+    unsigned long t, stall;
+    dp.fail = 0;
+    if(!bus.on || !cfg.stall)
+        return;
+    for(t = Rand() % (2 * every); t < dp.end - dp.start;
+            t += Rand() % (2 * every)) {
+        stall = Rand() % cfg.stall;
+        if(stall <= fifo)
+            continue;
+        bus.stalls++;
+        if(!(sdio_regs.CLKCR & _BV(14))) {
+            dp.fail = dp.read ? SDIO_FLAG_RXOVERR : SDIO_FLAG_TXUNDERR;
+            dp.fail_at = dp.start + t + fifo;
+            return;
+        }
+        dp.end += stall - fifo;     // SDIO_CK stopped
+        if(Rand() % 8 == 0) {
+            dp.fail = SDIO_FLAG_DCRCFAIL;
+            dp.fail_at = dp.start + (t / block + 1) * block;
+            if((long)(dp.fail_at - dp.end) > 0)
+                dp.fail_at = dp.end;
+            return;
+        }
+    }
+}
+
+/* both cards, one not selected finishes programming all the same */
+static void CardTime(void)
+{
+    struct card* c;
+    for(c = cards; c < cards + 2; c++)
+        if(((c->state == ST_DATA) || (c->state == ST_PRG))
+                && c->until && ((long)(Now() - c->until) >= 0))
+            c->state = ST_TRAN;
+}
+
+static uint32_t R1(int state)
+{
+    uint32_t r1 = card->err | (uint32_t)state << 9;
+    if((state != ST_RCV) && (state != ST_PRG))
+        r1 |= R1_READY_FOR_DATA;
+    card->err = 0;
+    return (r1);
+}
+
+/* data command accepted: the card sends from start, or waits for blocks */
+static void CardRead(const uint8_t* reg, uint32_t len, uint32_t addr,
+        uint32_t nblocks)
+{
+    card->reg = reg;
+    card->reglen = len;
+    card->addr = addr;
+    card->left = nblocks;
+    card->state = ST_DATA;
+    card->start = Now() + cfg.access;
+    card->until = (nblocks || reg) ? card->start + (reg ? len : nblocks * 512UL)
+            * ByteTicks() : 0;
+}
+
+static void CardWrite(uint32_t addr, uint32_t nblocks)
+{
+    card->addr = addr;
+    card->left = nblocks;
+    card->got = 0;
+    card->state = ST_RCV;
+    card->until = 0;
+}
+
+static void CardProgram(unsigned long ticks)
+{
+    card->state = ST_PRG;
+    card->until = Now() + ticks;
+}
+
+static bool OutOfRange(uint32_t addr, uint32_t nblocks)
+{
+    return (addr >= CARD_SECTORS) || (nblocks > CARD_SECTORS - addr);
+}
+
+/* the application commands the card knows, after CMD55 */
+static bool AppCommand(uint32_t idx, int state, uint32_t* resp, bool* r1)
+{
+    if(idx == 41) {     // ACMD41, ready on the second try
+        *r1 = false;
+        if(state != ST_IDLE)
+            return false;
+        resp[0] = 0x40ff8000 | (card->ready ? 0x80000000 : 0);
+        if(card->ready)
+            card->state = ST_READY;
+        card->ready = true;
+        return true;
+    }
+    if(state != ST_TRAN) {
+        card->err |= R1_ILLEGAL_COMMAND;
+        return false;
+    }
+    resp[0] = R1(state) | R1_APP_CMD;
+    if(idx == 13)       // SD status
+        CardRead(card->sd_status, sizeof(card->sd_status), 0, 0);
+    else if(idx == 51)  // SCR
+        CardRead(card->scr, sizeof(card->scr), 0, 0);
+    return true;        // ACMD6 bus width, ACMD23 pre-erase count
+}
+
+/* one command, answered at once; false: no response */
+static bool Command(uint32_t idx, uint32_t arg, uint32_t* resp, bool* r1)
+{
+    bool app = card->app;
+    int state = card->state;
+    uint32_t count = card->count;
+    card->app = false;
+    card->count = 0;
+    *r1 = true;
+    if(app && ((idx == 41) || (idx == 6) || (idx == 13) || (idx == 23)
+            || (idx == 51)))
+        return AppCommand(idx, state, resp, r1);
+    switch(idx) {
+    case 0:
+        card->state = ST_IDLE;
+        card->ready = false;
+        card->err = 0;
+        return true;
+    case 8:     // R7
+        if(state != ST_IDLE)
+            break;
+        resp[0] = arg & 0xfff;
+        return true;
+    case 55:
+        resp[0] = R1(state) | R1_APP_CMD;
+        card->app = true;
+        return true;
+    case 2:     // CID
+        if(state != ST_READY)
+            break;
+        *r1 = false;
+        resp[0] = 0x035344ff;
+        resp[1] = 0x53494d31;
+        resp[2] = 0x10000001;
+        resp[3] = 0x0001a100;
+        card->state = ST_IDENT;
+        return true;
+    case 3:     // R6
+        if((state != ST_IDENT) && (state != ST_STBY))
+            break;
+        resp[0] = CARD_RCA << 16 | (uint32_t)state << 9;
+        card->state = ST_STBY;
+        return true;
+    case 9:     // CSD 2.0, C_SIZE from CARD_SECTORS
+        if(state != ST_STBY)
+            break;
+        *r1 = false;
+        resp[0] = 0x400e0032;
+        resp[1] = 0x5b590000 | ((CARD_SECTORS / 1024 - 1) >> 16 & 0x3f);
+        resp[2] = (CARD_SECTORS / 1024 - 1) << 16 | 0x7f80;
+        resp[3] = 0x0a400000;
+        return true;
+    case 7:
+        if((arg >> 16) != CARD_RCA) {
+            card->state = ST_STBY;
+            return false;
+        }
+        if((state != ST_STBY) && (state != ST_TRAN))
+            break;
+        resp[0] = R1(state);
+        card->state = ST_TRAN;
+        return true;
+    case 13:
+        resp[0] = R1(state);
+        return true;
+    case 16:
+        if(state != ST_TRAN)
+            break;
+        if(arg != 512)
+            card->err |= R1_BLOCK_LEN_ERROR;
+        resp[0] = R1(state);
+        return true;
+    case 23:
+        if(state != ST_TRAN || !cfg.cmd23)
+            break;
+        resp[0] = R1(state);
+        card->count = arg & 0xffff;
+        return true;
+    case 17:
+    case 18:
+    case 24:
+    case 25:
+        if(state != ST_TRAN)
+            break;
+        count = (idx == 17 || idx == 24) ? 1 : count;
+        if(OutOfRange(arg, count ? count : 1)) {
+            card->err |= R1_OUT_OF_RANGE;
+            resp[0] = R1(state);
+            return true;
+        }
+        resp[0] = R1(state);
+        if(idx < 24)
+            CardRead(NULL, 0, arg, count);
+        else
+            CardWrite(arg, count);
+        return true;
+    case 12:
+        if(state == ST_DATA) {
+            if(!card->until && !card->reg)
+                dwt.CYCCNT += cfg.access;   // open ended: next block fetched
+            card->state = ST_TRAN;
+        }
+        else if(state == ST_RCV)
+            CardProgram(card->got ? cfg.prog : 0);
+        else
+            break;
+        resp[0] = R1(state);
+        return true;
+    case 32:
+    case 33:
+        if(state != ST_TRAN)
+            break;
+        if(idx == 32)
+            card->erase_first = arg;
+        else
+            card->erase_last = arg;
+        resp[0] = R1(state);
+        return true;
+    case 38:
+        if(state != ST_TRAN)
+            break;
+        if((card->erase_last < card->erase_first)
+                || OutOfRange(card->erase_first,
+                        card->erase_last - card->erase_first + 1))
+            card->err |= R1_OUT_OF_RANGE;
+        else
+            memset(card->mem + card->erase_first * 512UL, 0,
+                    (card->erase_last - card->erase_first + 1) * 512UL);
+        resp[0] = R1(state);
+        CardProgram(cfg.erase);
+        return true;
+    case 5:     // not an I/O card
+    default:
+        return false;
+    }
+    card->err |= R1_ILLEGAL_COMMAND;
+    return false;
+}
+
+static void Cpsm(void)
+{
+    uint32_t cmd = sdio_regs.CMD, resp[4] = {0};
+    uint32_t wait = cmd & SDIO_Response_Long;
+    bool r1, ok;
+    sdio_regs.CMD = cmd & ~SDIO_CPSM_Enable;
+    dwt.CYCCNT += (wait ? (wait == SDIO_Response_Long ? 184 : 104) : 56)
+            * ClockTicks();
+    CardTime();
+    ok = Command(cmd & 0x3f, sdio_regs.ARG, resp, &r1);
+    if(!wait) {
+        sdio_regs.STA |= SDIO_FLAG_CMDSENT;
+        return;
+    }
+    if(!ok) {
+        sdio_regs.STA |= SDIO_FLAG_CTIMEOUT;
+        return;
+    }
+    sdio_regs.RESPCMD = r1 ? (cmd & 0x3f) : 0x3f;
+    sdio_regs.RESP1 = resp[0];
+    sdio_regs.RESP2 = resp[1];
+    sdio_regs.RESP3 = resp[2];
+    sdio_regs.RESP4 = resp[3];
+    sdio_regs.STA |= SDIO_FLAG_CMDREND;
+}
+
+/* the data of an armed transfer is all across */
+static void DataDone(void)
+{
+    uint8_t* mem = (uint8_t*)dma2c4.CMAR;
+    uint32_t n = dp.dlen;
+    if(dp.read) {
+        if(card->reg)
+            memcpy(mem, card->reg, (n < card->reglen) ? n : card->reglen);
+        else if(!OutOfRange(card->addr, n / 512))
+            memcpy(mem, card->mem + card->addr * 512UL, n);
+        card->addr += n / 512;
+    }
+    else {
+        if(!OutOfRange(card->addr, n / 512))
+            memcpy(card->mem + card->addr * 512UL, mem, n);
+        card->addr += n / 512;
+        card->got += n / 512;
+        if(card->left && (card->got >= card->left))
+            CardProgram(cfg.prog);
+    }
+    dp.armed = dp.moving = false;
+    dp.tc = true;
+    dma2c4.CNDTR = 0;
+    sdio_regs.DCOUNT = 0;
+    sdio_regs.STA |= SDIO_FLAG_DATAEND | SDIO_FLAG_DBCKEND;
+}
+
+static void Dpsm(void)
+{
+    unsigned long now = Now();
+    if(sdio_regs.DCTRL & SDIO_DPSM_Enable) {
+        sdio_regs.DCTRL &= ~SDIO_DPSM_Enable;
+        dp.armed = true;
+        dp.moving = false;
+        dp.read = sdio_regs.DCTRL & SDIO_TransferDir_ToSDIO;
+        dp.dlen = sdio_regs.DLEN;
+        sdio_regs.DCOUNT = dp.dlen;
+    }
+    if(dp.moving && !(dma2c4.CCR & DMA_CCR1_EN)) {     // aborted
+        dp.armed = dp.moving = false;
+        return;
+    }
+    if(dp.armed && !dp.moving && (sdio_regs.DCTRL & _BV(3))
+            && (dma2c4.CCR & DMA_CCR1_EN)) {
+        if(dp.read && (card->state == ST_DATA))
+            dp.start = ((long)(now - card->start) > 0) ? now : card->start;
+        else if(!dp.read && (card->state == ST_RCV))
+            dp.start = now;
+        else
+            return;
+        dp.end = dp.start + dp.dlen * ByteTicks();
+        dp.moving = true;
+        Contention();
+    }
+    if(!dp.moving)
+        return;
+    if(dp.fail && ((long)(now - dp.fail_at) >= 0)) {
+        sdio_regs.STA |= dp.fail;   // the DPSM stops, the block is lost
+        dp.armed = dp.moving = false;
+        bus.errors++;
+        return;
+    }
+    if((long)(now - dp.end) >= 0) {
+        DataDone();
+        return;
+    }
+    if((long)(now - dp.start) > 0) {    // words across so far
+        uint32_t done = (uint32_t)((now - dp.start) / ByteTicks()) & ~3UL;
+        sdio_regs.DCOUNT = dp.dlen - done;
+        dma2c4.CNDTR = (dp.dlen - done) / 4;
+    }
+}
+
+static void Step(void)
+{
+    if(sdio_regs.ICR) {
+        sdio_regs.STA &= ~sdio_regs.ICR;
+        sdio_regs.ICR = 0;
+    }
+    if(sdio_regs.CMD & SDIO_CPSM_Enable)
+        Cpsm();
+    CardTime();
+    Dpsm();
+}
+
+static void Arrive(void)
+{
+    static uint32_t buf[8 * 128];
+    SD_Req* r;
+    if(!lat.on || lat.in || sim_primask || (lat.n == LAT_READS)
+            || ((long)(Now() - lat.next) < 0))
+        return;
+    lat.in = true;
+    r = &lat.req[lat.n];
+    *r = (SD_Req){.lba = CARD_SECTORS / 2 + (lat.n * 64) % (CARD_SECTORS / 4),
+            .nblocks = 8, .buff = buf};
+    if(SD_SchedSubmit(r) == SD_OK)
+        lat.n++;
+    lat.next += lat.every;
+    lat.in = false;
+}
+
+DWT_Type* sim_dwt(void)
+{
+    dwt.CYCCNT += TICKS_PER_READ;
+    Step();
+    Arrive();
+    return &dwt;
+}
+
+void SDIO_DeInit(void)
+{
+    memset((void*)&sdio_regs, 0, sizeof(sdio_regs));
+    dp.armed = dp.moving = false;
+}
+
+void RCC_AHBPeriphClockCmd(uint32_t periph, FunctionalState state)
+{
+    (void)periph;
+    (void)state;
+}
+
+void DMA_Init(DMA_Channel_TypeDef* ch, DMA_InitTypeDef* init)
+{
+    ch->CCR = init->DMA_DIR | init->DMA_PeripheralInc | init->DMA_MemoryInc
+            | init->DMA_PeripheralDataSize | init->DMA_MemoryDataSize
+            | init->DMA_Mode | init->DMA_Priority | init->DMA_M2M;
+    ch->CNDTR = init->DMA_BufferSize;
+    ch->CPAR = init->DMA_PeripheralBaseAddr;
+    ch->CMAR = init->DMA_MemoryBaseAddr;
+}
+
+void DMA_Cmd(DMA_Channel_TypeDef* ch, FunctionalState state)
+{
+    if(state != DISABLE)
+        ch->CCR |= DMA_CCR1_EN;
+    else
+        ch->CCR &= ~DMA_CCR1_EN;
+    Step();
+}
+
+void DMA_ClearFlag(uint32_t flag)
+{
+    Step();
+    if(flag == DMA2_FLAG_TC4)
+        dp.tc = false;
+}
+
+FlagStatus DMA_GetFlagStatus(uint32_t flag)
+{
+    Step();
+    return ((flag == DMA2_FLAG_TC4) && dp.tc) ? SET : RESET;
+}
+
+static void CardInit(struct card* c)
+{
+    static const uint8_t scr[8] = {0x02, 0x35, 0x80, 0x02};
+    c->mem = calloc(CARD_SECTORS, 512);
+    if(c->mem == NULL) {
+        perror("sd_sim");
+        exit(1);
+    }
+    memcpy(c->scr, scr, sizeof(scr));
+    if(!cfg.cmd23)
+        c->scr[3] &= ~0x2;
+    c->sd_status[10] = 0x90;    // AU 4 MiB
+    c->sd_status[12] = 1;       // ERASE_SIZE 1 AU
+    c->sd_status[13] = 1 << 2 | 1;  // ERASE_TIMEOUT 1 s, ERASE_OFFSET 1 s
+}
+
+/* board switches of the RAID run */
+static void Select0(void)
+{
+    card = &cards[0];
+}
+
+static void Select1(void)
+{
+    card = &cards[1];
+}
+
+static double Us(unsigned long ticks)
+{
+    return ticks / (SystemCoreClock / 1e6);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: sd_sim [-s seed] [-n count] [-f rate] [-b ms]"
+            " [-a us] [-p us] [-2] [-c us] [-w] [-r kb] [-l kb]"
+            " [-x count]\n");
+    exit(2);
+}
+
+/* one -l pass; ticks of the write, 0 when something failed */
+static unsigned long LatPass(bool sliced, unsigned long kb,
+        SD_SchedStats* st)
+{
+    static SD_Req w;
+    static uint32_t* buf;
+    unsigned long t;
+    SD_Error ret;
+    if((buf == NULL) && ((buf = calloc(kb, 1024)) == NULL)) {
+        perror("sd_sim");
+        exit(1);
+    }
+    w = (SD_Req){.lba = 0, .nblocks = kb * 2, .buff = buf, .write = true};
+    lat.n = 0;
+    lat.next = Now() + lat.every;
+    SD_SchedGetStats(st, true);
+    t = Now();
+    lat.on = true;
+    if(sliced) {
+        ret = SD_SchedSubmit(&w);
+        while((ret == SD_OK) && (w.ret == SD_REQUEST_PENDING))
+            ret = SD_SchedDispatch();    // may serve reads first
+        ret = w.ret;
+    }
+    else
+        ret = SD_WriteSectors(w.lba, w.buff, w.nblocks);
+    t = Now() - t;
+    lat.on = false;
+    while(SD_SchedDispatch() != SD_REQUEST_NOT_APPLICABLE)
+        ;
+    for(uint32_t i = 0; i < lat.n; i++)
+        if(lat.req[i].ret != SD_OK)
+            ret = lat.req[i].ret;
+    SD_SchedGetStats(st, false);
+    if(ret != SD_OK) {
+        fprintf(stderr, "%s pass: %d\n", sliced ? "sliced" : "whole", ret);
+        return 0;
+    }
+    return (t);
+}
+
+static int LatRun(unsigned long kb, bool hwfc)
+{
+    SD_SchedStats st[2];
+    unsigned long t[2];
+    if(kb * 2 > CARD_SECTORS / 2) {
+        fprintf(stderr, "sd_sim: -l over %lu kB\n", CARD_SECTORS / 4);
+        return 2;
+    }
+    lat.every = SystemCoreClock / 1000;
+    if(SD_Init() != SD_OK) {
+        fprintf(stderr, "SD_Init failed\n");
+        return 1;
+    }
+    SD_SetFlowControl(hwfc);
+    bus.on = true;
+    for(int i = 0; i < 2; i++) {
+        t[i] = LatPass(i, kb, &st[i]);
+        if(!t[i])
+            return 1;
+    }
+    printf("%lu kB write, 8 sector reads every 1 ms, programming %.0f us\n",
+            kb, Us(cfg.prog));
+    printf("%-8s %9s %6s %9s %12s %12s\n", "write", "write us", "reads",
+            "preempted", "wait avg us", "wait max us");
+    for(int i = 0; i < 2; i++)
+        printf("%-8s %9.0f %6lu %9lu %12.1f %12.1f\n",
+                i ? "sliced" : "whole", Us(t[i]), st[i].count[0],
+                st[i].preempted, st[i].count[0]
+                ? Us(st[i].wait_sum[0]) / st[i].count[0] : 0.0,
+                Us(st[i].wait_max[0]));
+    return 0;
+}
+
+/* -x: the setup report of n writes and n reads of 8 sectors, through
+ * prepared descriptors and through the classic calls */
+static int XferRun(unsigned long n)
+{
+    static uint32_t buf[8 * 128];
+    SD_Xfer x[2];
+    SD_SetupStats st[2];
+    SD_Error ret = SD_OK;
+    unsigned long i, lba;
+    int k;
+    if(SD_Init() != SD_OK) {
+        fprintf(stderr, "SD_Init failed\n");
+        return 1;
+    }
+    SD_XferPrep(&x[0], true, 8);
+    SD_XferPrep(&x[1], false, 8);
+    for(k = 0; k < 2; k++) {
+        SD_GetSetupStats(&st[k], true);
+        for(i = 0; (i < n) && (ret == SD_OK); i++) {
+            lba = 1024 + i % 1024 * 8;
+            if(k == 0)
+                ret = SD_XferRun(&x[i & 1], lba, buf);
+            else
+                ret = (i & 1) ? SD_ReadSectors(lba, buf, 8)
+                        : SD_WriteSectors(lba, buf, 8);
+        }
+        SD_GetSetupStats(&st[k], false);
+        if(ret != SD_OK) {
+            fprintf(stderr, "%s pass: %d\n", k ? "classic" : "prepared", ret);
+            return 1;
+        }
+    }
+    printf("%lu requests of 8 sectors, half writes, CMD23 %s\n", n,
+            cfg.cmd23 ? "on" : "off");
+    printf("%-9s %8s %12s %12s\n", "path", "commands", "setup avg us",
+            "setup max us");
+    for(k = 0; k < 2; k++)
+        printf("%-9s %8lu %12.1f %12.1f\n", k ? "classic" : "prepared",
+                st[k].count, st[k].count ? Us(st[k].sum) / st[k].count : 0.0,
+                Us(st[k].max));
+    return 0;
+}
+
+#define RAID_REQ    128     // sectors per request, two stripes
+
+static uint32_t raid_buf[2][RAID_REQ * 128];    // data, read back
+
+static void RaidFill(unsigned long lba)
+{
+    for(uint32_t i = 0; i < RAID_REQ * 128; i++)
+        raid_buf[0][i] = (lba + i / 128) * 0x9E3779B1UL + i % 128;
+}
+
+static SD_Error Flush(void)
+{
+    SD_Error ret = SD_OK;
+    bool busy;
+    do {
+        ret = SD_CardBusy(&busy);
+    } while((ret == SD_OK) && busy);
+    return (ret);
+}
+
+/* kb of writes, posted on both setups so only the overlap differs, then
+ * read back; ticks of the writes and the reads in t[], false when one
+ * failed or a read back differed */
+static bool RaidPass(bool raid, unsigned long kb, unsigned long t[2])
+{
+    unsigned long lba, n = kb * 2;
+    SD_Error ret = SD_OK;
+    t[0] = Now();
+    for(lba = 0; (lba < n) && (ret == SD_OK); lba += RAID_REQ) {
+        RaidFill(lba);
+        ret = raid ? SD_RaidWrite(lba, raid_buf[0], RAID_REQ)
+                : SD_WriteSectors(lba, raid_buf[0], RAID_REQ);
+    }
+    if(ret == SD_OK)
+        ret = raid ? SD_RaidFlush() : Flush();
+    t[0] = Now() - t[0];
+    t[1] = Now();
+    for(lba = 0; (lba < n) && (ret == SD_OK); lba += RAID_REQ) {
+        ret = raid ? SD_RaidRead(lba, raid_buf[1], RAID_REQ)
+                : SD_ReadSectors(lba, raid_buf[1], RAID_REQ);
+        RaidFill(lba);
+        if((ret == SD_OK) && memcmp(raid_buf[0], raid_buf[1],
+                sizeof(raid_buf[0])))
+            ret = SD_ERROR;
+    }
+    t[1] = Now() - t[1];
+    if(ret != SD_OK) {
+        fprintf(stderr, "%s pass: %d\n", raid ? "raid" : "single", ret);
+        return false;
+    }
+    return true;
+}
+
+static int RaidRun(unsigned long kb)
+{
+    SD_Card* c[2];
+    SD_RaidStats st;
+    unsigned long one[2], two[2];
+    bool posted, ok;
+    int i;
+    kb = (kb + 63) / 64 * 64;   // whole requests
+    if(kb * 2 > CARD_SECTORS) {
+        fprintf(stderr, "sd_sim: -r over %lu kB\n", CARD_SECTORS / 2);
+        return 2;
+    }
+    c[0] = SD_CardAttach(SDIO, DMA2_Channel4, DMA2_FLAG_TC4, Select0);
+    c[1] = SD_CardAttach(SDIO, DMA2_Channel4, DMA2_FLAG_TC4, Select1);
+    for(i = 0; i < 2; i++) {
+        SD_Select(c[i]);
+        if(SD_Init() != SD_OK) {
+            fprintf(stderr, "SD_Init card %d failed\n", i);
+            return 1;
+        }
+    }
+    SD_Select(c[0]);
+    posted = SD_SetPostedWrites(true);
+    ok = RaidPass(false, kb, one);
+    SD_SetPostedWrites(posted);
+    if(SD_RaidInit(c[0], c[1]) != SD_OK)
+        return 1;
+    if(!ok || !RaidPass(true, kb, two))
+        return 1;
+    SD_RaidGetStats(&st, false);
+    printf("%lu kB, programming %.0f us per write, CMD23 %s\n", kb,
+            Us(cfg.prog), cfg.cmd23 ? "on" : "off");
+    printf("%-9s %9s %8s %9s %8s\n", "", "write us", "MB/s", "read us",
+            "MB/s");
+    for(i = 0; i < 2; i++) {
+        unsigned long* t = i ? two : one;
+        printf("%-9s %9.0f %8.2f %9.0f %8.2f\n", i ? "raid-0" : "one card",
+                Us(t[0]), kb * 1024 / Us(t[0]), Us(t[1]),
+                kb * 1024 / Us(t[1]));
+    }
+    printf("written and read: %lu + %lu sectors, %lu card switches\n",
+            st.sectors[0], st.sectors[1], st.switches);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* names[SD_STRESS_CLASSES] = {"cmd crc", "cmd timeout",
+            "data crc", "data timeout", "fifo", "busy"};
+    SD_StressCfg sc = {.lba = 1024, .nsectors = 256, .requests = 2000,
+            .busy_ms = 50, .seed = 1};
+    SD_StressReport rep;
+    SD_TimeoutStats tmo;
+    SD_FifoStats fifo;
+    SD_SetupStats setup;
+    SD_Error ret;
+    unsigned long rate = 20, clk, raid = 0, lkb = 0, nx = 0;
+    bool hwfc = false;
+    int opt, i;
+    while((opt = getopt(argc, argv, "s:n:f:b:a:p:2c:wr:l:x:")) != -1) {
+        switch(opt) {
+        case 's': sc.seed = strtoul(optarg, NULL, 0); break;
+        case 'n': sc.requests = strtoul(optarg, NULL, 0); break;
+        case 'f': rate = strtoul(optarg, NULL, 0); break;
+        case 'b': sc.busy_ms = strtoul(optarg, NULL, 0); break;
+        case 'a': cfg.access = strtoul(optarg, NULL, 0); break;
+        case 'p': cfg.prog = strtoul(optarg, NULL, 0); break;
+        case '2': cfg.cmd23 = false; break;
+        case 'c': cfg.stall = strtoul(optarg, NULL, 0); break;
+        case 'w': hwfc = true; break;
+        case 'r': raid = strtoul(optarg, NULL, 0); break;
+        case 'l': lkb = strtoul(optarg, NULL, 0); break;
+        case 'x': nx = strtoul(optarg, NULL, 0); break;
+        default: usage();
+        }
+    }
+    if(optind != argc)
+        usage();
+    for(i = 0; i < SD_STRESS_CLASSES; i++)
+        sc.rate[i] = rate;
+    cfg.access *= SystemCoreClock / 1000000;
+    cfg.prog *= SystemCoreClock / 1000000;
+    cfg.erase *= SystemCoreClock / 1000000;
+    cfg.stall *= SystemCoreClock / 1000000;
+    bus.rand = sc.seed;
+    CardInit(&cards[0]);
+    CardInit(&cards[1]);
+    SD_SetPioThreshold(0);
+    if(raid)
+        return RaidRun(raid);
+    if(lkb)
+        return LatRun(lkb, hwfc);
+    if(nx)
+        return XferRun(nx);
+    ret = SD_Init();
+    if(ret != SD_OK) {
+        fprintf(stderr, "SD_Init: %d\n", ret);
+        return 1;
+    }
+    printf("card %lu kB, AU %lu kB, CMD23 %s\n", SD_GetCardSize(),
+            SD_GetAUSize(), cfg.cmd23 ? "on" : "off");
+    SD_SetFlowControl(hwfc);
+    clk = SystemCoreClock / ClockTicks();
+    bus.on = true;
+    ret = SD_StressRun(&sc, &rep);
+    bus.on = false;
+    SD_GetTimeoutStats(&tmo, false);
+    SD_GetFifoStats(&fifo, false);
+    SD_GetSetupStats(&setup, false);
+    printf("%lu requests, %lu sectors, seed %lu\n", rep.requests, rep.sectors,
+            sc.seed);
+    printf("clean %.0f us, with faults %.0f us\n", Us(rep.clean_ticks),
+            Us(rep.fault_ticks));
+    printf("%-13s %8s %8s %12s %12s %12s\n", "class", "injected", "failed",
+            "recover avg", "recover max", "lost us");
+    for(i = 0; i < SD_STRESS_CLASSES; i++) {
+        SD_StressClass* c = &rep.cls[i];
+        unsigned long ok = c->injected - c->failed;
+        printf("%-13s %8lu %8lu %12.1f %12.1f %12.0f\n", names[i],
+                c->injected, c->failed, ok ? Us(c->recover_sum) / ok : 0.0,
+                Us(c->recover_max), Us(c->lost));
+    }
+    printf("errors %lu, corrupt sectors %lu\n", rep.errors, rep.corrupt);
+    printf("timeouts: cmd %lu, data %lu, busy %lu; fifo: overruns %lu,"
+            " underruns %lu, crc %lu, retries %lu, failed %lu\n", tmo.cmd,
+            tmo.data, tmo.busy, fifo.overruns, fifo.underruns, fifo.crc,
+            fifo.retries, fifo.failed);
+    printf("setup: %lu data commands, call to command avg %.1f us,"
+            " max %.1f us\n", setup.count,
+            setup.count ? Us(setup.sum) / setup.count : 0.0, Us(setup.max));
+    if(cfg.stall)
+        printf("contention: %lu stalls over the FIFO, %lu transfers hit,"
+                " %.1f MB/s clean; SDIO_CK %lu kHz, %lu kHz at the end\n",
+                bus.stalls, bus.errors, rep.sectors * 512 / Us(rep.clean_ticks),
+                clk / 1000, SystemCoreClock / ClockTicks() / 1000);
+    return (ret == SD_OK) ? 0 : 1;
+}
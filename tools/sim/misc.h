@@ -0,0 +1,153 @@
+/* Host stand-in for the STM32F10x SPL, just what sdio_f1.c and the layers
+ * use, for building them against the controller and card model of
+ * tools/sd_sim.c. Registers are plain memory the model reads and sets;
+ * DWT is a call, so every tick read lets the model move on. Pointer sized
+ * where the driver stores a pointer (DMA addresses, the cycle counter
+ * the driver keeps in unsigned long). */
+#ifndef _SIM_MISC_H
+#define _SIM_MISC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define __IO volatile
+#define _BV(x) (1UL << (x))
+#define _dbg() do {} while(0)
+
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, ITStatus;
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} FunctionalState;
+
+typedef struct {
+    __IO uint32_t POWER, CLKCR, ARG, CMD;
+    __IO uint32_t RESPCMD, RESP1, RESP2, RESP3, RESP4;
+    __IO uint32_t DTIMER, DLEN, DCTRL, DCOUNT, STA, ICR, MASK;
+    uint32_t RESERVED0[2];
+    __IO uint32_t FIFOCNT;
+    uint32_t RESERVED1[13];
+    __IO uint32_t FIFO;
+} SDIO_TypeDef;
+extern SDIO_TypeDef sdio_regs;
+#define SDIO (&sdio_regs)
+
+typedef struct {
+    __IO uint32_t DR;
+    __IO uint8_t IDR;
+    uint8_t RESERVED0;
+    uint16_t RESERVED1;
+    __IO uint32_t CR;
+} CRC_TypeDef;
+extern CRC_TypeDef crc_regs;
+#define CRC (&crc_regs)
+#define CRC_CR_RESET 1UL
+
+typedef struct {
+    __IO uint32_t CTRL;
+    __IO unsigned long CYCCNT;
+} DWT_Type;
+typedef struct {
+    __IO uint32_t DHCSR, DCRSR, DCRDR, DEMCR;
+} CoreDebug_Type;
+DWT_Type* sim_dwt(void);    // advances time and the model
+extern CoreDebug_Type cd_regs;
+#define DWT (sim_dwt())
+#define CoreDebug (&cd_regs)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk (1UL)
+extern uint32_t SystemCoreClock;
+
+static inline void __DMB(void) {}
+static inline void __DSB(void) {}
+extern uint32_t sim_primask;    // the model holds its "interrupts" while set
+static inline void __disable_irq(void) { sim_primask = 1; }
+static inline void __enable_irq(void) { sim_primask = 0; }
+static inline uint32_t __get_PRIMASK(void) { return sim_primask; }
+static inline void __set_PRIMASK(uint32_t x) { sim_primask = x; }
+static inline uint32_t __REV(uint32_t x) { return __builtin_bswap32(x); }
+static inline uint32_t __CLZ(uint32_t x) { return x ? __builtin_clz(x) : 32; }
+
+#define SDIO_FLAG_CCRCFAIL      0x1UL
+#define SDIO_FLAG_DCRCFAIL      0x2UL
+#define SDIO_FLAG_CTIMEOUT      0x4UL
+#define SDIO_FLAG_DTIMEOUT      0x8UL
+#define SDIO_FLAG_TXUNDERR      0x10UL
+#define SDIO_FLAG_RXOVERR       0x20UL
+#define SDIO_FLAG_CMDREND       0x40UL
+#define SDIO_FLAG_CMDSENT       0x80UL
+#define SDIO_FLAG_DATAEND       0x100UL
+#define SDIO_FLAG_STBITERR      0x200UL
+#define SDIO_FLAG_DBCKEND       0x400UL
+#define SDIO_FLAG_CMDACT        0x800UL
+#define SDIO_FLAG_TXACT         0x1000UL
+#define SDIO_FLAG_RXACT         0x2000UL
+#define SDIO_FLAG_TXFIFOHE      0x4000UL
+#define SDIO_FLAG_RXFIFOHF      0x8000UL
+#define SDIO_FLAG_TXFIFOF       0x10000UL
+#define SDIO_FLAG_RXFIFOF       0x20000UL
+#define SDIO_FLAG_TXFIFOE       0x40000UL
+#define SDIO_FLAG_RXFIFOE       0x80000UL
+#define SDIO_FLAG_TXDAVL        0x100000UL
+#define SDIO_FLAG_RXDAVL        0x200000UL
+#define SDIO_FLAG_SDIOIT        0x400000UL
+#define SDIO_IT_SDIOIT          0x400000UL
+#define SDIO_CPSM_Enable        0x400UL
+#define SDIO_Response_No        0x0UL
+#define SDIO_Response_Short     0x40UL
+#define SDIO_Response_Long      0xC0UL
+#define SDIO_Wait_No            0UL
+#define SDIO_DataBlockSize_1b   0UL
+#define SDIO_DataBlockSize_512b 0x90UL
+#define SDIO_TransferDir_ToCard 0UL
+#define SDIO_TransferDir_ToSDIO 0x2UL
+#define SDIO_TransferMode_Block 0UL
+#define SDIO_DPSM_Enable        1UL
+#define SDIO_DPSM_Disable       0UL
+#define SDIO_BusWide_1b         0UL
+#define SDIO_BusWide_4b         0x800UL
+#define SDIO_BusWide_8b         0x1000UL
+#define SDIO_PowerState_ON      3UL
+#define SDIO_PowerState_OFF     0UL
+#define SDIO_RESP1              0UL
+#define SDIO_RESP2              4UL
+#define SDIO_RESP3              8UL
+#define SDIO_RESP4              12UL
+void SDIO_DeInit(void);
+void SDIO_ClearITPendingBit(uint32_t it);
+ITStatus SDIO_GetITStatus(uint32_t it);
+void SDIO_ITConfig(uint32_t it, FunctionalState state);
+
+typedef struct {
+    __IO uint32_t CCR, CNDTR;
+    __IO unsigned long CPAR, CMAR;
+} DMA_Channel_TypeDef;
+extern DMA_Channel_TypeDef dma2c4;
+#define DMA2_Channel4 (&dma2c4)
+typedef struct {
+    unsigned long DMA_PeripheralBaseAddr, DMA_MemoryBaseAddr;
+    uint32_t DMA_DIR, DMA_BufferSize, DMA_PeripheralInc, DMA_MemoryInc;
+    uint32_t DMA_PeripheralDataSize, DMA_MemoryDataSize, DMA_Mode;
+    uint32_t DMA_Priority, DMA_M2M;
+} DMA_InitTypeDef;
+#define DMA_DIR_PeripheralSRC       0UL
+#define DMA_DIR_PeripheralDST       0x10UL
+#define DMA_PeripheralInc_Disable   0UL
+#define DMA_MemoryInc_Enable        0x80UL
+#define DMA_PeripheralDataSize_Word 0x200UL
+#define DMA_MemoryDataSize_Word     0x800UL
+#define DMA_Mode_Normal             0UL
+#define DMA_Mode_Circular           0x20UL
+#define DMA_Priority_High           0x2000UL
+#define DMA_M2M_Disable             0UL
+#define DMA2_FLAG_TC4               0x10002000UL
+#define DMA2_FLAG_TE4               0x10008000UL
+#define DMA_CCR1_EN                 1UL
+void DMA_Cmd(DMA_Channel_TypeDef* ch, FunctionalState state);
+void DMA_Init(DMA_Channel_TypeDef* ch, DMA_InitTypeDef* init);
+void DMA_ClearFlag(uint32_t flag);
+FlagStatus DMA_GetFlagStatus(uint32_t flag);
+
+#define RCC_AHBPeriph_SDIO  0x400UL
+#define RCC_AHBPeriph_DMA2  0x2UL
+#define RCC_AHBPeriph_CRC   0x40UL
+void RCC_AHBPeriphClockCmd(uint32_t periph, FunctionalState state);
+
+#endif